@@ -15,6 +15,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include "utility.h"
+#include "ir.h"
 #include <sys/mman.h>
 #include <arpa/inet.h>
 
@@ -160,83 +161,44 @@ uint64_t make_word(uint64_t word, unsigned width, unsigned lsb,
 
 size_t compile_instruction(void *zero, Instruction word, size_t offset)
 {
-    uint32_t opcode = (word >> 28) & 0xF;
-    uint32_t a = 0;
-
     uint8_t *p = (uint8_t *)zero + offset;
+    Ir_Insn insn = ir_decode(word);
+    unsigned a = insn.a, b = insn.b, c = insn.c;
 
-    /* Load Value */
-    if (opcode == 13)
+    switch (insn.op)
     {
-        a = (word >> 25) & 0x7;
-        uint32_t val = word & 0x1FFFFFF;
-        offset += load_reg(p, a, val);
-        return offset;
+    case IR_CONST:
+        return offset + load_reg(p, a, insn.value);
+    case IR_OUT:
+        return offset + print_reg(p, c);
+    case IR_ADD:
+        return offset + add_regs(p, a, b, c);
+    case IR_HALT:
+        return offset + handle_halt(p);
+    case IR_NAND:
+        return offset + nand_regs(p, a, b, c);
+    case IR_MUL:
+        return offset + mult_regs(p, a, b, c);
+    case IR_DIV:
+        return offset + div_regs(p, a, b, c);
+    case IR_CMOV:
+        return offset + cond_move(p, a, b, c);
+    case IR_IN:
+        return offset + read_into_reg(p, c);
+    case IR_LOAD:
+        return offset + seg_load(p, a, b, c);
+    case IR_STORE:
+        return offset + seg_store(p, a, b, c);
+    case IR_JUMP:
+        return offset + inject_load_program(p, b, c);
+    case IR_MAP:
+        return offset + inject_map_segment(p, b, c);
+    case IR_UNMAP:
+        return offset + inject_unmap_segment(p, c);
+    default:
+        /* Invalid Opcode */
+        return offset + CHUNK;
     }
-
-    uint32_t b = 0, c = 0;
-
-    c = word & 0x7;
-    b = (word >> 3) & 0x7;
-    a = (word >> 6) & 0x7;
-
-    /* Output */
-    if (opcode == 10)
-        offset += print_reg(p, c);
-
-    /* Addition */
-    else if (opcode == 3)
-        offset += add_regs(p, a, b, c);
-
-    /* Halt */
-    else if (opcode == 7)
-        offset += handle_halt(p);
-
-    /* Bitwise NAND */
-    else if (opcode == 6)
-        offset += nand_regs(p, a, b, c);
-
-    /* Multiplication */
-    else if (opcode == 4)
-        offset += mult_regs(p, a, b, c);
-
-    /* Division */
-    else if (opcode == 5)
-        offset += div_regs(p, a, b, c);
-
-    /* Conditional Move */
-    else if (opcode == 0)
-        offset += cond_move(p, a, b, c);
-
-    /* Input */
-    else if (opcode == 11)
-        offset += read_into_reg(p, c);
-
-    /* Segmented Load */
-    else if (opcode == 1)
-        offset += seg_load(p, a, b, c);
-
-    /* Segmented Store */
-    else if (opcode == 2)
-        offset += seg_store(p, a, b, c);
-
-    /* Load Program */
-    else if (opcode == 12)
-        offset += inject_load_program(p, b, c);
-
-    /* Map Segment */
-    else if (opcode == 8)
-        offset += inject_map_segment(p, b, c);
-
-    /* Unmap Segment */
-    else if (opcode == 9)
-        offset += inject_unmap_segment(p, c);
-
-    /* Invalid Opcode */
-    else
-        offset += CHUNK;
-
-    return offset;
 }
 
 size_t load_reg(uint8_t *p, unsigned a, uint32_t value)
@@ -0,0 +1,81 @@
+#ifndef IR_H
+#define IR_H
+
+/* Backend-neutral form of UM code, shared by the JITs for every architecture.
+ * The front end decodes words into instructions that name the registers they
+ * read and write, and splits a segment into basic blocks: straight-line runs
+ * that start where control can arrive and end at the first instruction that
+ * leaves the compiled code (Halt, Map, Unmap, Output, Input, Load Program).
+ * Passes rewrite blocks in place, and each backend lowers what is left to
+ * machine code. An instruction may be entered at any PC, so a backend keeps
+ * code for every word as well as for every block. */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The UM operations keep their opcodes */
+#define IR_CMOV 0
+#define IR_LOAD 1
+#define IR_STORE 2
+#define IR_ADD 3
+#define IR_MUL 4
+#define IR_DIV 5
+#define IR_NAND 6
+#define IR_HALT 7
+#define IR_MAP 8
+#define IR_UNMAP 9
+#define IR_OUT 10
+#define IR_IN 11
+#define IR_JUMP 12
+#define IR_CONST 13
+#define IR_NOP 14 /* Opcodes 14 and 15, which do nothing */
+
+/* What passes rewrite instructions into. value is a constant operand. */
+#define IR_MOV 16  /* rA = rB */
+#define IR_ADDK 17 /* rA = rB + value */
+#define IR_MULK 18 /* rA = rB * value */
+#define IR_SHR 19  /* rA = rB >> value */
+#define IR_DIVK 20 /* rA = rB / value, for value not a power of 2 */
+#define IR_NOT 21  /* rA = ~rB */
+#define IR_AND 22  /* rA = rB & rC */
+#define IR_OR 23   /* rA = rB | rC */
+#define IR_XOR 24  /* rA = rB ^ rC */
+#define IR_ANDN 25 /* rA = rB & ~rC */
+#define IR_ORN 26  /* rA = rB | ~rC */
+
+#define IR_MAX_BLOCK 256 /* Instructions in a block at most */
+
+typedef struct
+{
+    uint8_t op;
+    uint8_t a, b, c;  /* Registers, as the UM instruction names them */
+    uint8_t def;      /* Registers written, one bit each */
+    uint8_t use;      /* Registers read */
+    uint32_t value;   /* IR_CONST, and the constant operand of a pass's ops */
+} Ir_Insn;
+
+typedef struct
+{
+    uint32_t start;   /* PC of the first word */
+    uint32_t words;   /* Words of the segment the block covers */
+    uint32_t n;       /* Instructions, which passes may remove or rewrite */
+    Ir_Insn insns[IR_MAX_BLOCK];
+} Ir_Block;
+
+Ir_Insn ir_decode(uint32_t word);
+
+/* True for the instructions that end a block */
+bool ir_exits(uint8_t op);
+
+/* Where control can arrive other than by falling through: the start, every
+ * constant a Load Value puts in a register that is also a PC, and the word
+ * after every exit. One flag per word, for ir_block; free it when done. */
+bool *ir_leaders(const uint32_t *words, uint32_t n);
+
+/* Decode the block that starts at pc. It runs to its exit, inclusive, or up
+ * to the next leader, the end of the segment or IR_MAX_BLOCK instructions.
+ * Returns the PC after it. */
+uint32_t ir_block(const uint32_t *words, uint32_t n, const bool *leader,
+                  uint32_t pc, Ir_Block *block);
+
+#endif
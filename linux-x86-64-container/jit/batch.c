@@ -0,0 +1,256 @@
+/**
+ * @file batch.c
+ * @brief
+ * Batch runner. Compiles a .um program once and runs it against many input
+ * files on a pool of threads, each with a VM of its own, sharing the compiled
+ * code. The output for each input file goes to the same path with .out
+ * appended. With -q or -l, every input gets a VM of its own instead and the
+ * libumjit scheduler time-slices them all, killing any that run too long.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "umjit.h"
+
+#define MAX_THREADS 256
+#define DEFAULT_SLICE ((uint64_t)1 << 20)
+
+typedef struct
+{
+    Umjit_Program_T *prog;
+    char **inputs;
+    int n;
+    int next;          /* The work queue: inputs from here on are unclaimed */
+    int failed;
+    pthread_mutex_t lock;
+} Batch_T;
+
+static int claim(Batch_T *b)
+{
+    pthread_mutex_lock(&b->lock);
+    int i = b->next < b->n ? b->next++ : -1;
+    pthread_mutex_unlock(&b->lock);
+    return i;
+}
+
+static void fail(Batch_T *b, const char *path)
+{
+    fprintf(stderr, "File %s could not be processed.\n", path);
+    pthread_mutex_lock(&b->lock);
+    b->failed++;
+    pthread_mutex_unlock(&b->lock);
+}
+
+static uint8_t *read_file(const char *path, size_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return NULL;
+
+    size_t cap = 4096;
+    uint8_t *data = malloc(cap);
+    assert(data != NULL);
+
+    *len = 0;
+    size_t got;
+    while ((got = fread(data + *len, 1, cap - *len, fp)) > 0)
+    {
+        *len += got;
+        if (*len == cap)
+        {
+            cap *= 2;
+            data = realloc(data, cap);
+            assert(data != NULL);
+        }
+    }
+
+    fclose(fp);
+    return data;
+}
+
+static int write_output(const char *input, Umjit_Buffers *buf)
+{
+    size_t len = strlen(input);
+    char *path = malloc(len + sizeof(".out"));
+    assert(path != NULL);
+    memcpy(path, input, len);
+    memcpy(path + len, ".out", sizeof(".out"));
+
+    FILE *fp = fopen(path, "wb");
+    free(path);
+    if (fp == NULL)
+        return -1;
+
+    size_t put = fwrite(buf->out, 1, buf->out_len, fp);
+    return (fclose(fp) == 0 && put == buf->out_len) ? 0 : -1;
+}
+
+/* One worker: a VM of its own, reset between inputs so its arena is reused */
+static void *worker(void *cl)
+{
+    Batch_T *b = cl;
+    Umjit_T *vm = umjit_new();
+    umjit_use(vm, b->prog);
+
+    Umjit_Buffers buf = {NULL, 0, 0, NULL, 0, 0};
+    umjit_set_io(vm, umjit_buffer_io(&buf));
+
+    bool fresh = true;
+    int i;
+    while ((i = claim(b)) >= 0)
+    {
+        size_t len;
+        uint8_t *in = read_file(b->inputs[i], &len);
+        if (in == NULL)
+        {
+            fail(b, b->inputs[i]);
+            continue;
+        }
+
+        if (!fresh)
+            umjit_reset(vm);
+        fresh = false;
+
+        buf.in = in;
+        buf.in_len = len;
+        buf.in_pos = 0;
+        buf.out_len = 0;
+        umjit_run(vm);
+
+        if (write_output(b->inputs[i], &buf) != 0)
+            fail(b, b->inputs[i]);
+        free(in);
+    }
+
+    free(buf.out);
+    umjit_free(&vm);
+    return NULL;
+}
+
+/* Every input at once, each on its own VM, under the scheduler */
+static void run_scheduled(Batch_T *b, unsigned threads, uint64_t slice,
+                          uint64_t limit)
+{
+    Umjit_T **vms = calloc(b->n, sizeof(Umjit_T *));
+    Umjit_Buffers *bufs = calloc(b->n, sizeof(Umjit_Buffers));
+    assert(vms != NULL && bufs != NULL);
+
+    Umjit_Sched_T *sched = umjit_sched_new(threads, slice);
+    for (int i = 0; i < b->n; i++)
+    {
+        size_t len;
+        uint8_t *in = read_file(b->inputs[i], &len);
+        if (in == NULL)
+        {
+            fail(b, b->inputs[i]);
+            continue;
+        }
+
+        bufs[i].in = in;
+        bufs[i].in_len = len;
+        vms[i] = umjit_new();
+        umjit_use(vms[i], b->prog);
+        umjit_set_io(vms[i], umjit_buffer_io(&bufs[i]));
+        umjit_sched_add(sched, vms[i], limit);
+    }
+
+    umjit_sched_run(sched);
+    umjit_sched_free(&sched);
+
+    for (int i = 0; i < b->n; i++)
+    {
+        if (vms[i] == NULL)
+            continue;
+
+        if (umjit_status(vms[i]) == UMJIT_KILLED)
+        {
+            fprintf(stderr, "Input %s was stopped after %lu jumps.\n",
+                    b->inputs[i], limit);
+            b->failed++;
+        }
+
+        if (write_output(b->inputs[i], &bufs[i]) != 0)
+            fail(b, b->inputs[i]);
+
+        umjit_free(&vms[i]);
+        free((uint8_t *)bufs[i].in);
+        free(bufs[i].out);
+    }
+
+    free(vms);
+    free(bufs);
+}
+
+int main(int argc, char *argv[])
+{
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t slice = 0;
+    uint64_t limit = 0;
+    bool bad_usage = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:q:l:")) != -1)
+    {
+        if (opt == 'j')
+            threads = strtol(optarg, NULL, 10);
+        else if (opt == 'q')
+            slice = strtoull(optarg, NULL, 10);
+        else if (opt == 'l')
+            limit = strtoull(optarg, NULL, 10);
+        else
+            bad_usage = true;
+    }
+
+    if (bad_usage || threads < 1 || optind > argc - 2)
+    {
+        fprintf(stderr, "Usage: ./batch [-j threads] [-q slice] [-l limit] "
+                        "[executable.um] [input ...]\n");
+        return EXIT_FAILURE;
+    }
+
+    const char *path = argv[optind];
+    Batch_T b;
+    b.prog = umjit_compile_file(path);
+    if (b.prog == NULL)
+    {
+        fprintf(stderr, "File %s could not be opened.\n", path);
+        return EXIT_FAILURE;
+    }
+
+    b.inputs = argv + optind + 1;
+    b.n = argc - optind - 1;
+    b.next = 0;
+    b.failed = 0;
+    pthread_mutex_init(&b.lock, NULL);
+
+    if (threads > b.n)
+        threads = b.n;
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+
+    if (slice != 0 || limit != 0)
+    {
+        run_scheduled(&b, threads, slice ? slice : DEFAULT_SLICE, limit);
+        pthread_mutex_destroy(&b.lock);
+        umjit_program_free(&b.prog);
+        return b.failed ? EXIT_FAILURE : 0;
+    }
+
+    pthread_t pool[MAX_THREADS];
+    for (long t = 0; t < threads; t++)
+    {
+        int result = pthread_create(&pool[t], NULL, worker, &b);
+        assert(result == 0);
+    }
+    for (long t = 0; t < threads; t++)
+        pthread_join(pool[t], NULL);
+
+    pthread_mutex_destroy(&b.lock);
+    umjit_program_free(&b.prog);
+    return b.failed ? EXIT_FAILURE : 0;
+}
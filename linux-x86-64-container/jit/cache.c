@@ -0,0 +1,287 @@
+#include "cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "utility.h"
+#include "lower.h"
+
+/* Whatever the compiler emits can differ from one build to the next */
+#define CODE_KEY "x86-64 " __DATE__ " " __TIME__
+
+#define CACHE_MAGIC "UMCODE01"
+#define CACHE_MAGIC_LEN 8
+#define CACHE_HEADER_SIZE 4096 /* The code starts on a page of its own */
+
+/* The shared region is sparse, so only what is published takes memory */
+#define SHARED_SIZE ((uint64_t)1 << 32)
+#define SHARED_SLOTS (1 << 16)
+#define SHARED_PROBES 64
+#define PAGE 4096
+
+bool cache_enabled = false;
+
+static char *cache_dir;
+
+typedef struct
+{
+    uint64_t lo;
+    uint64_t hi;
+} Hash_T;
+
+typedef struct
+{
+    char magic[CACHE_MAGIC_LEN];
+    Hash_T hash;
+    uint32_t words;
+    uint32_t chunk;
+    uint64_t code_len;
+} Entry_T;
+
+/* A slot is claimed by swapping its lo from 0 to the key's, and is ready
+ * for readers once ready is set; a slot whose writer died stays unready */
+typedef struct
+{
+    atomic_uint_least64_t lo;
+    uint64_t hi;
+    uint64_t offset; /* From the start of the code area */
+    uint64_t code_len;
+    uint32_t words;
+    atomic_uint ready;
+} Slot_T;
+
+/* The start of the shared region. All zeros is an empty cache, so a new
+ * region needs no setting up. */
+typedef struct
+{
+    atomic_uint_least64_t next; /* Bytes of the code area handed out */
+    Slot_T slots[SHARED_SLOTS];
+} Shared_T;
+
+#define CODE_AREA (((sizeof(Shared_T) + PAGE - 1) / PAGE) * PAGE)
+
+static Shared_T *shared;
+static int shared_fd = -1;
+
+static inline uint64_t rotl(uint64_t x, unsigned r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/* Two independent 64 bit lanes over the key, the mode, the CPU features the
+ * code may use and the words */
+static Hash_T hash_segment(const uint32_t *words, uint32_t n, bool indirect)
+{
+    uint64_t lo = 0xcbf29ce484222325;
+    uint64_t hi = 0x9e3779b97f4a7c15 ^ n;
+
+    for (const char *k = CODE_KEY; *k; k++)
+        lo = (lo ^ (uint8_t)*k) * 0x100000001b3;
+    lo = (lo ^ indirect) * 0x100000001b3;
+    lo = (lo ^ lower_features()) * 0x100000001b3;
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        lo = (lo ^ words[i]) * 0x100000001b3;
+        hi = rotl(hi + words[i] * 0xc2b2ae3d27d4eb4f, 31) * 0x9e3779b97f4a7c15;
+    }
+
+    hi ^= lo;
+    hi = (hi ^ (hi >> 33)) * 0xff51afd7ed558ccd;
+    hi ^= hi >> 33;
+
+    /* A zero lo marks a free shared slot */
+    return (Hash_T){lo | 1, hi};
+}
+
+static void entry_path(char *path, size_t size, Hash_T h)
+{
+    snprintf(path, size, "%s/%016lx%016lx", cache_dir, h.hi, h.lo);
+}
+
+void cache_open(const char *dir)
+{
+    mkdir(dir, 0755);
+    cache_dir = strdup(dir);
+    cache_enabled = cache_enabled || cache_dir != NULL;
+}
+
+void cache_share(const char *name)
+{
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+
+    /* Whoever gets here first sizes the region; the rest find it sized */
+    struct stat st;
+    if ((fstat(fd, &st) != 0 || (uint64_t)st.st_size != SHARED_SIZE) &&
+        ftruncate(fd, SHARED_SIZE) != 0)
+    {
+        close(fd);
+        return;
+    }
+
+    void *table = mmap(NULL, CODE_AREA, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       fd, 0);
+    if (table == MAP_FAILED)
+    {
+        close(fd);
+        return;
+    }
+
+    shared = table;
+    shared_fd = fd;
+    cache_enabled = true;
+}
+
+/* Readers never wait: a slot still being written is a miss */
+static void *shared_lookup(Hash_T h, uint32_t n, size_t *code_len)
+{
+    for (uint32_t p = 0; p < SHARED_PROBES; p++)
+    {
+        Slot_T *s = &shared->slots[(h.lo + p) & (SHARED_SLOTS - 1)];
+        uint64_t lo = atomic_load_explicit(&s->lo, memory_order_acquire);
+        if (lo == 0)
+            return NULL;
+        if (lo != h.lo)
+            continue;
+        if (!atomic_load_explicit(&s->ready, memory_order_acquire))
+            return NULL;
+        if (s->hi != h.hi || s->words != n)
+            continue;
+
+        void *code = mmap(NULL, s->code_len, PROT_READ | PROT_EXEC,
+                          MAP_SHARED, shared_fd, CODE_AREA + s->offset);
+        if (code == MAP_FAILED)
+            return NULL;
+        *code_len = s->code_len;
+        return code;
+    }
+
+    return NULL;
+}
+
+static void shared_store(Hash_T h, uint32_t n, const void *code,
+                         size_t code_len)
+{
+    for (uint32_t p = 0; p < SHARED_PROBES; p++)
+    {
+        Slot_T *s = &shared->slots[(h.lo + p) & (SHARED_SLOTS - 1)];
+        uint64_t lo = 0;
+        if (!atomic_compare_exchange_strong(&s->lo, &lo, h.lo))
+        {
+            /* Another process has this segment, or is publishing it */
+            if (lo == h.lo && s->hi == h.hi)
+                return;
+            continue;
+        }
+
+        /* Code starts on a page of its own so that it can be mapped */
+        uint64_t len = (code_len + PAGE - 1) / PAGE * PAGE;
+        uint64_t offset = atomic_fetch_add(&shared->next, len);
+        if (CODE_AREA + offset + len > SHARED_SIZE ||
+            pwrite(shared_fd, code, code_len, CODE_AREA + offset) !=
+                (ssize_t)code_len)
+            return;
+
+        s->hi = h.hi;
+        s->offset = offset;
+        s->code_len = code_len;
+        s->words = n;
+        atomic_store_explicit(&s->ready, 1, memory_order_release);
+        return;
+    }
+}
+
+static void *dir_lookup(Hash_T h, uint32_t n, size_t *code_len)
+{
+    char path[PATH_MAX];
+    entry_path(path, sizeof(path), h);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    /* A short file, which mapping would turn into SIGBUS, is skipped */
+    Entry_T e;
+    struct stat st;
+    void *code = NULL;
+    if (pread(fd, &e, sizeof(e), 0) == sizeof(e) &&
+        memcmp(e.magic, CACHE_MAGIC, CACHE_MAGIC_LEN) == 0 &&
+        e.hash.lo == h.lo && e.hash.hi == h.hi && e.words == n &&
+        e.chunk == CHUNK && e.code_len > 0 && fstat(fd, &st) == 0 &&
+        (uint64_t)st.st_size >= CACHE_HEADER_SIZE + e.code_len)
+    {
+        code = mmap(NULL, e.code_len, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd,
+                    CACHE_HEADER_SIZE);
+        if (code == MAP_FAILED)
+            code = NULL;
+        *code_len = e.code_len;
+    }
+
+    close(fd);
+    return code;
+}
+
+static void dir_store(Hash_T h, uint32_t n, const void *code,
+                      size_t code_len)
+{
+    Entry_T e;
+    memcpy(e.magic, CACHE_MAGIC, CACHE_MAGIC_LEN);
+    e.hash = h;
+    e.words = n;
+    e.chunk = CHUNK;
+    e.code_len = code_len;
+
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    entry_path(path, sizeof(path), e.hash);
+    snprintf(tmp, sizeof(tmp), "%s/.tmpXXXXXX", cache_dir);
+
+    /* A cache that cannot be written to is only a slower cache */
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+        return;
+
+    bool ok = fchmod(fd, 0644) == 0 &&
+              pwrite(fd, &e, sizeof(e), 0) == sizeof(e) &&
+              pwrite(fd, code, code_len, CACHE_HEADER_SIZE) ==
+                  (ssize_t)code_len;
+
+    if (close(fd) != 0 || !ok || rename(tmp, path) != 0)
+        unlink(tmp);
+}
+
+void *cache_lookup(const uint32_t *words, uint32_t n, bool indirect,
+                   size_t *code_len)
+{
+    Hash_T h = hash_segment(words, n, indirect);
+    void *code = NULL;
+    if (shared != NULL)
+        code = shared_lookup(h, n, code_len);
+
+    /* Code from disk is published for the other processes on the way */
+    if (code == NULL && cache_dir != NULL)
+    {
+        code = dir_lookup(h, n, code_len);
+        if (code != NULL && shared != NULL)
+            shared_store(h, n, code, *code_len);
+    }
+
+    return code;
+}
+
+void cache_store(const uint32_t *words, uint32_t n, bool indirect,
+                 const void *code, size_t code_len)
+{
+    Hash_T h = hash_segment(words, n, indirect);
+    if (shared != NULL)
+        shared_store(h, n, code, code_len);
+    if (cache_dir != NULL)
+        dir_store(h, n, code, code_len);
+}
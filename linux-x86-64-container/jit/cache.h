@@ -0,0 +1,36 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+/* Compiled code cache.
+ * With a cache directory set, every segment the JIT compiles is stored there
+ * as a file holding its machine code, and later runs map that file instead of
+ * compiling the segment again. Generated code reaches everything through
+ * rbx, rbp and rcx, so it is position-independent and needs no relocation.
+ * An entry is named by a 128 bit hash of the words it was compiled from, the
+ * addressing mode, the CPU features the code may use (see lower.h) and the
+ * code key, which changes with every build of the compiler. Entries are written to a temporary file and renamed into place,
+ * so processes can share a directory.
+ * The cache can also live in a named POSIX shared memory region, which every
+ * process on the host that names it maps. Segments are published there
+ * without locks and mapped shared, so processes running one program hold a
+ * single copy of its code between them. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+extern bool cache_enabled;
+
+void cache_open(const char *dir);
+
+void cache_share(const char *name);
+
+/* The cached code for n words, mapped read-only and executable, or NULL.
+ * Sets *code_len to its length. */
+void *cache_lookup(const uint32_t *words, uint32_t n, bool indirect,
+                   size_t *code_len);
+
+void cache_store(const uint32_t *words, uint32_t n, bool indirect,
+                 const void *code, size_t code_len);
+
+#endif
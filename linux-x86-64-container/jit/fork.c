@@ -0,0 +1,81 @@
+/**
+ * @file fork.c
+ * @brief
+ * Fork server for libumjit. The memory system is set up and the program is
+ * compiled once, in the server. Every request then gets a copy-on-write child
+ * that starts running the program right away.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "umjit.h"
+
+/* The child: the connection becomes its stdin and stdout */
+static void serve(Umjit_T *vm, int listener, int conn)
+{
+    close(listener);
+    if (dup2(conn, STDIN_FILENO) < 0 || dup2(conn, STDOUT_FILENO) < 0)
+        _exit(EXIT_FAILURE);
+    close(conn);
+
+    umjit_set_io(vm, umjit_stdio());
+    umjit_run(vm);
+
+    /* Nothing else needs tearing down in a process about to exit */
+    fflush(stdout);
+    _exit(0);
+}
+
+int umjit_fork_server(Umjit_T *vm, const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0)
+        return -1;
+
+    unlink(path);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listener, SOMAXCONN) != 0)
+    {
+        close(listener);
+        return -1;
+    }
+
+    /* Children are never waited for */
+    signal(SIGCHLD, SIG_IGN);
+
+    /* Anything still buffered would be written once by every child */
+    fflush(stdout);
+
+    for (;;)
+    {
+        int conn = accept(listener, NULL, NULL);
+        if (conn < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        pid_t pid = fork();
+        if (pid == 0)
+            serve(vm, listener, conn);
+
+        close(conn);
+        if (pid < 0)
+            break;
+    }
+
+    close(listener);
+    return -1;
+}
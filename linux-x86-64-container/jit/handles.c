@@ -0,0 +1,110 @@
+#include "handles.h"
+#include "virt.h"
+#include <sys/mman.h>
+
+uint8_t **handles = NULL;
+
+/* IDs below next_id have been handed out at least once. Freed IDs are
+ * recycled before the table grows. */
+static uint32_t next_id;
+static Stack_T free_ids;
+
+static uint8_t *segment_alloc(uint32_t size)
+{
+    uint32_t *seg = calloc(1, (size_t)size + BOOK_SIZE);
+    if (seg == NULL)
+    {
+        fprintf(stderr, "Error: Out of memory for a %u byte segment\n", size);
+        exit(EXIT_FAILURE);
+    }
+
+    seg[0] = size;
+    seg[1] = size;
+    return (uint8_t *)(seg + 2);
+}
+
+uint8_t **init_handle_table(uint32_t kernel_size)
+{
+    assert(handles == NULL);
+
+    /* Only the slots that actually get used are ever backed by memory */
+    void *table = mmap(NULL, HANDLE_SLOTS * sizeof(uint8_t *),
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(table != MAP_FAILED);
+    handles = table;
+
+    /* Segment 0 is always the kernel */
+    handles[0] = segment_alloc(kernel_size);
+    next_id = 1;
+    free_ids.stack = malloc(INIT_STACK_SIZE * sizeof(uint32_t));
+    assert(free_ids.stack != NULL);
+    free_ids.size = 0;
+    free_ids.capacity = INIT_STACK_SIZE;
+
+    return handles;
+}
+
+void terminate_handle_table(void)
+{
+    for (uint32_t i = 0; i < next_id; i++)
+    {
+        if (handles[i] != NULL)
+            free(handles[i] - BOOK_SIZE);
+    }
+
+    munmap(handles, HANDLE_SLOTS * sizeof(uint8_t *));
+    free(free_ids.stack);
+    handles = NULL;
+}
+
+/* Handle Segment Calloc (hs_calloc):
+ * Allocate a zeroed segment anywhere in memory and give it a table slot */
+uint32_t hs_calloc(uint32_t size)
+{
+    uint32_t id;
+    if (!stack_is_empty(free_ids))
+    {
+        id = stack_top(free_ids);
+        free_ids = stack_pop(free_ids);
+    }
+    else
+    {
+        if (next_id == HANDLE_SLOTS)
+        {
+            fprintf(stderr, "Error: Out of segment handles\n");
+            exit(EXIT_FAILURE);
+        }
+
+        id = next_id++;
+    }
+
+    handles[id] = segment_alloc(size);
+    return id;
+}
+
+/* Handle Segment Free (hs_free):
+ * Release a segment and make its ID available again */
+void hs_free(uint32_t id)
+{
+    free(handles[id] - BOOK_SIZE);
+    handles[id] = NULL;
+    stack_push(&free_ids, id);
+}
+
+/* Handle Kernel (Re)allocate (hs_kern_realloc):
+ * Resize the zero segment, moving it if it has to grow. Returns the new
+ * kernel base address. */
+uint8_t *hs_kern_realloc(uint32_t size)
+{
+    uint32_t *kern = (uint32_t *)handles[0];
+    if (kern[-2] < size)
+    {
+        free(handles[0] - BOOK_SIZE);
+        handles[0] = segment_alloc(size);
+        kern = (uint32_t *)handles[0];
+    }
+
+    kern[-1] = size;
+    return handles[0];
+}
@@ -0,0 +1,33 @@
+#ifndef HANDLES_H
+#define HANDLES_H
+
+/* Indirect addressing mode.
+ * Segment IDs index a table of 64-bit base pointers instead of being byte
+ * offsets into the 4 GB Virt32 arena. The JIT pays one extra load per
+ * segmented load or store, but segments can live anywhere in the 64-bit
+ * address space and can move without their IDs changing. Every segment keeps
+ * the same bookkeeping words as a Virt32 segment: capacity at [-2] and size
+ * in bytes at [-1]. */
+
+#include <stdint.h>
+
+#define HANDLE_SLOTS ((uint64_t)1 << 28) /* Reserved, not committed */
+
+/* Segments live outside the arena, but their bookkeeping words still count
+ * bytes in 32 bits */
+#define MAX_HANDLE_SEGMENT ((uint64_t)UINT32_MAX)
+
+extern uint8_t **handles;
+
+/* Handle table interface */
+uint8_t **init_handle_table(uint32_t kernel_size);
+
+void terminate_handle_table(void);
+
+uint32_t hs_calloc(uint32_t size);
+
+void hs_free(uint32_t id);
+
+uint8_t *hs_kern_realloc(uint32_t size);
+
+#endif
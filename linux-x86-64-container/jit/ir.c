@@ -0,0 +1,114 @@
+/**
+ * @file ir.c
+ * @brief
+ * The front end every JIT shares: decoding UM words into the IR, and finding
+ * basic blocks (see ir.h).
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include "ir.h"
+
+#define BIT(r) (1u << (r))
+
+Ir_Insn ir_decode(uint32_t word)
+{
+    Ir_Insn insn = {.op = word >> 28};
+
+    /* Load Value */
+    if (insn.op == IR_CONST)
+    {
+        insn.a = (word >> 25) & 0x7;
+        insn.value = word & 0x1FFFFFF;
+        insn.def = BIT(insn.a);
+        return insn;
+    }
+
+    insn.a = (word >> 6) & 0x7;
+    insn.b = (word >> 3) & 0x7;
+    insn.c = word & 0x7;
+    uint8_t a = BIT(insn.a), b = BIT(insn.b), c = BIT(insn.c);
+
+    switch (insn.op)
+    {
+    case IR_CMOV:
+        /* rA keeps its value when rC is 0 */
+        insn.def = a;
+        insn.use = a | b | c;
+        break;
+    case IR_LOAD:
+    case IR_ADD:
+    case IR_MUL:
+    case IR_DIV:
+    case IR_NAND:
+        insn.def = a;
+        insn.use = b | c;
+        break;
+    case IR_STORE:
+        insn.use = a | b | c;
+        break;
+    case IR_HALT:
+        break;
+    case IR_MAP:
+        insn.def = b;
+        insn.use = c;
+        break;
+    case IR_UNMAP:
+    case IR_OUT:
+        insn.use = c;
+        break;
+    case IR_IN:
+        insn.def = c;
+        break;
+    case IR_JUMP:
+        insn.use = b | c;
+        break;
+    default:
+        insn.op = IR_NOP;
+        break;
+    }
+
+    return insn;
+}
+
+bool ir_exits(uint8_t op)
+{
+    return op >= IR_HALT && op <= IR_JUMP;
+}
+
+bool *ir_leaders(const uint32_t *words, uint32_t n)
+{
+    bool *leader = calloc((size_t)n + 1, sizeof(bool));
+    assert(leader != NULL);
+    if (n > 0)
+        leader[0] = true;
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint32_t op = words[i] >> 28;
+        if (op == IR_CONST && (words[i] & 0x1FFFFFF) < n)
+            leader[words[i] & 0x1FFFFFF] = true;
+        else if (ir_exits(op))
+            leader[i + 1] = true;
+    }
+
+    return leader;
+}
+
+uint32_t ir_block(const uint32_t *words, uint32_t n, const bool *leader,
+                  uint32_t pc, Ir_Block *block)
+{
+    block->start = pc;
+    block->n = 0;
+
+    do
+    {
+        Ir_Insn insn = ir_decode(words[pc++]);
+        block->insns[block->n++] = insn;
+        if (ir_exits(insn.op))
+            break;
+    } while (pc < n && !leader[pc] && block->n < IR_MAX_BLOCK);
+
+    block->words = pc - block->start;
+    return pc;
+}
@@ -4,7 +4,9 @@
  * @date January 2025
  * @brief 
  * A Just-In-Time compiler from Universal Machine assembly language to
- * x86 assembly language. Uses the Virt32 memory allocator.
+ * x86 assembly language. Uses the Virt32 memory allocator. Built as
+ * libumjit; see umjit.h for the interface and main.c for the command line
+ * tool.
  */
 
 #include <stdio.h>
@@ -15,702 +17,822 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include "utility.h"
 
 #include "virt.h"
+#include "handles.h"
+#include "stats.h"
+#include "trace.h"
+#include "cache.h"
+#include "um2c.h"
+#include "tier.h"
+#include "lower.h"
+#include "umjit.h"
 
 #define OPS 15
 #define INIT_CAP 32500
 
-/* Set this to 1 to handle recompiling. This flag will majorly throttle the
- * segmented store instruction by design: the entire program was designed around
- * the assumption this feature would not be implemented. */
-#define SELF_MODIFYING 0
-
-typedef uint32_t Instruction;
 typedef void *(*Function)(void);
 
-void *initialize_zero_segment(size_t fsize);
-void load_zero_segment(void *zero, uint8_t *umem, FILE *fp, size_t fsize);
-uint64_t make_word(uint64_t word, unsigned width, unsigned lsb, uint64_t value);
+bool indirect_mode = false;
 
-size_t compile_instruction(void *zero, uint32_t word, size_t offset);
-size_t load_reg(void *zero, size_t offset, unsigned a, uint32_t value);
-size_t cond_move(void *zero, size_t offset, unsigned a, unsigned b, unsigned c);
-size_t seg_load(void *zero, size_t offset, unsigned a, unsigned b, unsigned c);
-size_t seg_store(void *zero, size_t offset, unsigned a, unsigned b, unsigned c);
-size_t add_regs(void *zero, size_t offset, unsigned a, unsigned b, unsigned c);
-size_t mult_regs(void *zero, size_t offset, unsigned a, unsigned b, unsigned c);
-size_t div_regs(void *zero, size_t offset, unsigned a, unsigned b, unsigned c);
-size_t nand_regs(void *zero, size_t offset, unsigned a, unsigned b, unsigned c);
-size_t handle_halt(void *zero, size_t offset);
-uint32_t map_segment(uint32_t size, uint8_t *umem);
-size_t inject_map_segment(void *zero, size_t offset, unsigned b, unsigned c);
+/* Set when Map and Unmap must reach map_segment and unmap_segment rather than
+ * the fast paths in utility.S: for -i, -s and -t */
+bool slow_alloc = false;
 
-void unmap_segment(uint32_t segmentID);
-size_t inject_unmap_segment(void *zero, size_t offset, unsigned c);
+struct Umjit_Program_T
+{
+    uint32_t *image;   /* Host order words, copied into each zero segment */
+    uint32_t words;
+    uint8_t *code;     /* Read-only once compiled, so VMs can share it */
+    size_t code_size;
+};
 
-void print_out(uint32_t x);
-size_t print_reg(void *zero, size_t offset, unsigned c);
+struct Umjit_T
+{
+    Machine_T m;       /* First, so the handlers can get from it to the VM */
+    Umjit_IO io;
+    uint8_t *umem;     /* Virt32 usable base, or the handle table */
+    Umjit_Program_T *program;
+    bool owns_program; /* Loaded with umjit_load rather than shared */
+    bool ran;          /* Run since it was created or last reset */
+    size_t code_size;  /* Size of m.code when a Load Program compiled it */
+};
+
+/* utility.S works on the machine directly */
+_Static_assert(offsetof(Machine_T, regs) == MACHINE_REGS, "Machine_T.regs");
+_Static_assert(offsetof(Machine_T, pc) == MACHINE_PC, "Machine_T.pc");
+_Static_assert(offsetof(Machine_T, status) == MACHINE_STATUS,
+               "Machine_T.status");
+_Static_assert(offsetof(Machine_T, code) == MACHINE_CODE, "Machine_T.code");
+_Static_assert(offsetof(Machine_T, umem) == MACHINE_UMEM, "Machine_T.umem");
+_Static_assert(offsetof(Machine_T, fuel) == MACHINE_FUEL, "Machine_T.fuel");
+_Static_assert(offsetof(Machine_T, tier) == MACHINE_TIER, "Machine_T.tier");
+_Static_assert(offsetof(Machine_T, words) == MACHINE_WORDS,
+               "Machine_T.words");
+_Static_assert(MACHINE_HALTED == UMJIT_HALTED, "halted status");
+_Static_assert(MACHINE_OUT_OF_FUEL == UMJIT_OUT_OF_FUEL, "fuel status");
+_Static_assert(MACHINE_WAITING == UMJIT_WAITING, "waiting status");
+
+void load_zero_segment(Umjit_T *vm);
+
+uint32_t map_segment(uint32_t size, uint8_t *umem, size_t code_offset);
+void unmap_segment(uint32_t segmentID, uint8_t *umem, size_t code_offset);
+void print_out(uint32_t x, Machine_T *m);
+int64_t read_char(Machine_T *m);
+void past_end(Machine_T *m, uint32_t pc);
+void *load_program(uint32_t b_val, uint8_t *umem, Machine_T *m);
+static void install_code(Umjit_T *vm, uint8_t *kern, uint32_t num_words);
+
+
+static int stdio_get(void *cl)
+{
+    (void)cl;
+    return getchar();
+}
 
-unsigned char read_char(void);
-size_t read_into_reg(void *zero, size_t offset, unsigned c);
+static void stdio_put(uint8_t c, void *cl)
+{
+    (void)cl;
+    putchar(c);
+}
 
-void *load_program(uint32_t b_val, uint8_t *umem);
-size_t inject_load_program(void *zero, size_t offset, unsigned b, unsigned c);
+Umjit_IO umjit_stdio(void)
+{
+    return (Umjit_IO){stdio_get, stdio_put, NULL};
+}
 
+static int buffer_get(void *cl)
+{
+    Umjit_Buffers *b = cl;
+    if (b->in_pos == b->in_len)
+        return EOF;
+    return b->in[b->in_pos++];
+}
 
-int main(int argc, char *argv[])
+static void buffer_put(uint8_t c, void *cl)
 {
-    if (argc != 2)
+    Umjit_Buffers *b = cl;
+    if (b->out_len == b->out_cap)
     {
-        fprintf(stderr, "Usage: ./um [executable.um]\n");
-        return EXIT_FAILURE;
+        b->out_cap = b->out_cap ? 2 * b->out_cap : 256;
+        b->out = realloc(b->out, b->out_cap);
+        assert(b->out != NULL);
     }
 
-    FILE *fp = fopen(argv[1], "r");
+    b->out[b->out_len++] = c;
+}
 
-    if (fp == NULL)
-    {
-        fprintf(stderr, "File %s could not be opened.\n", argv[1]);
-        return EXIT_FAILURE;
-    }
+Umjit_IO umjit_buffer_io(Umjit_Buffers *buffers)
+{
+    return (Umjit_IO){buffer_get, buffer_put, buffers};
+}
 
+void umjit_use_indirect(void)
+{
+    indirect_mode = true;
+}
 
-    size_t fsize = 0;
-    struct stat file_stat;
-    if (stat(argv[1], &file_stat) == 0)
-    {
-        fsize = file_stat.st_size;
-        assert((fsize % 4) == 0);
-    }
+void umjit_use_cache(const char *dir)
+{
+    cache_open(dir);
+}
 
-    uint8_t *umem = init_memory_system(KERN_SIZE);
+void umjit_share_cache(const char *name)
+{
+    cache_share(name);
+}
 
-    /* Initialize executable and non-executable memory for the zero segment */
-    size_t asmbytes = fsize * ((CHUNK + 3) / 4);
-    void *zero = initialize_zero_segment(asmbytes);
+int umjit_use_tier(void)
+{
+    return tier_open() ? 0 : -1;
+}
 
-    load_zero_segment(zero, umem, fp, fsize);
-    fclose(fp);
+void umjit_use_tracer(void)
+{
+    tier_open_tracer();
+}
 
-    uint8_t *curr_seg = (uint8_t *)zero;
-    run(curr_seg, umem);
+Umjit_T *umjit_new(void)
+{
+    Umjit_T *vm = calloc(1, sizeof(Umjit_T));
+    assert(vm != NULL);
 
-    terminate_memory_system();
+    /* In indirect mode the JIT finds segments through the handle table, so
+     * that is what it gets in place of the Virt32 base address */
+    if (indirect_mode)
+        vm->umem = (uint8_t *)init_handle_table(KERN_SIZE);
+    else
+        vm->umem = init_memory_system(KERN_SIZE)->usable_mem;
 
-    return 0;
-}
+    if (stats_enabled)
+        stats_init(vs_context(vm->umem));
 
-void *initialize_zero_segment(size_t asmbytes)
-{
-    void *zero = mmap(NULL, asmbytes, PROT_READ | PROT_WRITE | PROT_EXEC,
-                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    assert(zero != MAP_FAILED);
+    slow_alloc = indirect_mode || stats_enabled || trace_enabled;
 
-    memset(zero, 0, asmbytes);
-    return zero;
+    vm->m.umem = vm->umem;
+    vm->io = umjit_stdio();
+    return vm;
 }
 
-void load_zero_segment(void *zero, uint8_t *umem, FILE *fp, size_t fsize)
+/* Give the VM a program of its own */
+static int adopt(Umjit_T *vm, Umjit_Program_T *prog)
 {
-    kern_realloc(fsize);
-    uint32_t word = 0;
-    int c;
-    int i = 0;
-    unsigned char c_char;
-    size_t offset = 0;
-
-    for (c = getc(fp); c != EOF; c = getc(fp))
+    if (umjit_use(vm, prog) != 0)
     {
-        c_char = (unsigned char)c;
-        if (i % 4 == 0)
-            word = make_word(word, 8, 24, c_char);
-        else if (i % 4 == 1)
-            word = make_word(word, 8, 16, c_char);
-        else if (i % 4 == 2)
-            word = make_word(word, 8, 8, c_char);
-        else if (i % 4 == 3)
-        {
-            word = make_word(word, 8, 0, c_char);
-            
-            set_at(umem, 0 + (i / 4) * sizeof(uint32_t), word);
-
-            /* Compile the UM word into machine code */
-            offset = compile_instruction(zero, word, offset);
-            word = 0;
-        }
-        i++;
+        umjit_program_free(&prog);
+        return -1;
     }
+
+    vm->owns_program = true;
+    return 0;
 }
 
-uint64_t make_word(uint64_t word, unsigned width, unsigned lsb,
-                       uint64_t value)
+/* Unmap whatever code the VM runs besides its program's */
+static void release_loaded_code(Umjit_T *vm)
 {
-    uint64_t mask = (uint64_t)1 << (width - 1);
-    mask = mask << 1;
-    mask -= 1;
-    mask = mask << lsb;
-    mask = ~mask;
-
-    uint64_t new_word = (word & mask);
-    value = value << lsb;
-    uint64_t return_word = (new_word | value);
-    return return_word;
+    if (vm->m.code != vm->program->code)
+        munmap(vm->m.code, vm->code_size);
+    vm->m.code = vm->program->code;
+    vm->code_size = 0;
 }
 
-size_t compile_instruction(void *zero, Instruction word, size_t offset)
+/* Point the machine and the optimizing tier at the words the VM's code was
+ * compiled from, keeping what the tier has compiled if they are the same */
+static void retier(Umjit_T *vm, const uint32_t *words, uint32_t n, bool copy)
 {
-    uint32_t opcode = (word >> 28) & 0xF;
-    uint32_t a = 0;
+    vm->m.words = n;
 
-    /* Load Value */
-    if (opcode == 13)
-    {
-        a = (word >> 25) & 0x7;
-        uint32_t val = word & 0x1FFFFFF;
-        offset += load_reg(zero, offset, a, val);
-        return offset;
-    }
+    Tier_T *t = vm->m.tier;
+    if (t != NULL && !copy && t->code == words)
+        return;
 
-    uint32_t b = 0, c = 0;
+    if (t != NULL)
+        tier_free(t);
+    vm->m.tier = NULL;
+    if (tier_enabled && !indirect_mode && words != NULL)
+        vm->m.tier = tier_new(words, n, copy);
+}
+
+/* Let go of the VM's program, freeing it if nothing else can use it */
+static void release_program(Umjit_T *vm)
+{
+    if (vm->program == NULL)
+        return;
+
+    release_loaded_code(vm);
+    if (vm->owns_program)
+        umjit_program_free(&vm->program);
+    vm->program = NULL;
+    retier(vm, NULL, 0, false);
+}
 
-    c = word & 0x7;
-    b = (word >> 3) & 0x7;
-    a = (word >> 6) & 0x7;
+void umjit_free(Umjit_T **vm)
+{
+    assert(vm != NULL && *vm != NULL);
+    Umjit_T *v = *vm;
 
-    /* Output */
-    if (opcode == 10)
+    if (stats_enabled)
     {
-        offset += print_reg(zero, offset, c);
+        stats_report(vs_context(v->umem));
+        stats_terminate();
     }
 
-    /* Addition */
-    else if (opcode == 3)
-    {
-        offset += add_regs(zero, offset, a, b, c);
-    }
+    release_program(v);
 
-    /* Halt */
-    else if (opcode == 7)
-    {
-        offset += handle_halt(zero, offset);
-    }
+    if (indirect_mode)
+        terminate_handle_table();
+    else
+        terminate_memory_system(vs_context(v->umem));
 
-    /* Bitwise NAND */
-    else if (opcode == 6)
-    {
-        offset += nand_regs(zero, offset, a, b, c);
-    }
+    free(v);
+    *vm = NULL;
+}
 
-    /* Addition */
-    else if (opcode == 3)
-    {
-        offset += add_regs(zero, offset, a, b, c);
-    }
+void umjit_set_io(Umjit_T *vm, Umjit_IO io)
+{
+    vm->io = io;
+}
 
-    /* Multiplication */
-    else if (opcode == 4)
+/* Compile a program from host order words, which it takes over */
+static Umjit_Program_T *compile_words(uint32_t *words, uint32_t n)
+{
+    Umjit_Program_T *prog = malloc(sizeof(Umjit_Program_T));
+    assert(prog != NULL);
+    prog->image = words;
+    prog->words = n;
+
+    /* Cached code is read-only, which only recompiling code minds */
+    bool cached = cache_enabled && !SELF_MODIFYING && n > 0;
+    if (cached)
     {
-        offset += mult_regs(zero, offset, a, b, c);
+        prog->code = cache_lookup(words, n, indirect_mode, &prog->code_size);
+        if (prog->code != NULL)
+            return prog;
     }
 
-    /* Division */
-    else if (opcode == 5)
-    {
-        offset += div_regs(zero, offset, a, b, c);
-    }
+    prog->code = lower_segment(words, n, &prog->code_size);
 
-    /* Conditional Move */
-    else if (opcode == 0)
+    /* Nothing writes to compiled code unless it may be recompiled */
+    int prot = PROT_READ | PROT_EXEC | (SELF_MODIFYING ? PROT_WRITE : 0);
+    if (prog->code_size > 0)
     {
-        offset += cond_move(zero, offset, a, b, c);
+        int result = mprotect(prog->code, prog->code_size, prot);
+        assert(result == 0);
     }
 
-    /* Input */
-    else if (opcode == 11)
-    {
-        offset += read_into_reg(zero, offset, c);
-    }
+    if (cached)
+        cache_store(words, n, indirect_mode, prog->code, prog->code_size);
 
-    /* Segmented Load */
-    else if (opcode == 1)
-    {
-        offset += seg_load(zero, offset, a, b, c);
-    }
+    return prog;
+}
 
-    /* Segmented Store */
-    else if (opcode == 2)
-    {
-        offset += seg_store(zero, offset, a, b, c);
-    }
+Umjit_Program_T *umjit_compile(const uint8_t *image, size_t len)
+{
+    if (len % sizeof(uint32_t) != 0 || len > KERN_RESERVE - BOOK_SIZE)
+        return NULL;
 
-    /* Load Program */
-    else if (opcode == 12)
+    uint32_t n = len / sizeof(uint32_t);
+    uint32_t *words = malloc(len + 1);
+    assert(words != NULL);
+    for (uint32_t i = 0; i < n; i++)
     {
-        offset += inject_load_program(zero, offset, b, c);
+        const uint8_t *w = image + i * sizeof(uint32_t);
+        words[i] = ((uint32_t)w[0] << 24) | ((uint32_t)w[1] << 16) |
+                   ((uint32_t)w[2] << 8) | w[3];
     }
 
-    /* Map Segment */
-    else if (opcode == 8)
-    {
-        offset += inject_map_segment(zero, offset, b, c);
-    }
+    return compile_words(words, n);
+}
 
-    /* Unmap Segment */
-    else if (opcode == 9)
-    {
-        offset += inject_unmap_segment(zero, offset, c);
-    }
+Umjit_Program_T *umjit_compile_file(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return NULL;
 
-    /* Invalid Opcode */
-    else
+    struct stat file_stat;
+    if (fstat(fileno(fp), &file_stat) != 0)
     {
-        offset += CHUNK;
+        fclose(fp);
+        return NULL;
     }
 
-    return offset;
+    size_t fsize = file_stat.st_size;
+    uint8_t *image = malloc(fsize + 1);
+    assert(image != NULL);
+    size_t got = fread(image, 1, fsize, fp);
+    fclose(fp);
+
+    Umjit_Program_T *prog = got == fsize ? umjit_compile(image, fsize) : NULL;
+    free(image);
+    return prog;
 }
 
-size_t load_reg(void *zero, size_t offset, unsigned a, uint32_t value)
+void umjit_program_free(Umjit_Program_T **prog)
 {
-    uint8_t *p = (uint8_t *)zero + offset;
-
-    /* Load 32 bit value into register rAd */
-    /* mov imm32, %rAd */
-    *p++ = 0x41;
-    *p++ = 0xC7;
-    *p++ = 0xC0 | a;
+    assert(prog != NULL && *prog != NULL);
+    Umjit_Program_T *p = *prog;
 
-    *p++ = value & 0xFF;
-    *p++ = (value >> 8) & 0xFF;
-    *p++ = (value >> 16) & 0xFF;
-    *p++ = (value >> 24) & 0xFF;
-
-    /* No Op */
-    *p++ = 0x0F;
-    *p++ = 0x1F;
-    *p++ = 0x00;
-
-    return CHUNK;
+    munmap(p->code, p->code_size);
+    free(p->image);
+    free(p);
+    *prog = NULL;
 }
 
-size_t cond_move(void *zero, size_t offset, unsigned a, unsigned b, unsigned c)
+int umjit_use(Umjit_T *vm, Umjit_Program_T *prog)
 {
-    uint8_t *p = (uint8_t *)zero + offset;
-
-    /* test %rCd, %rCd */
-    *p++ = 0x45;
-    *p++ = 0x85;
-    *p++ = 0xc0 | (c << 3) | c;
+    /* A VM holds one program at a time, and an indirect mode VM only ever
+     * holds one */
+    if (vm->program != NULL)
+    {
+        if (indirect_mode)
+            return -1;
+        release_program(vm);
+    }
 
-    /* If rCd is not 0, move %rAd into %rBd */
-    /* cmovne %rBd, %rAd */
-    *p++ = 0x45;
-    *p++ = 0x0F;
-    *p++ = 0x45;
-    *p++ = 0xC0 | (a << 3) | b;
+    vm->program = prog;
+    vm->owns_program = false;
+    vm->m.code = prog->code;
+    retier(vm, prog->image, prog->words, false);
 
-    /* No Op */
-    *p++ = 0x0F;
-    *p++ = 0x1F;
-    *p++ = 0x00;
+    /* A VM that has never run has nothing to reset, and an indirect mode
+     * VM, being only ever loaded once, never has */
+    if (indirect_mode || !vm->ran)
+        load_zero_segment(vm);
+    else
+        umjit_reset(vm);
 
-    return CHUNK;
+    return 0;
 }
 
-
-size_t seg_load(void *zero, size_t offset, unsigned a, unsigned b, unsigned c)
+int umjit_load(Umjit_T *vm, const uint8_t *image, size_t len)
 {
-    uint8_t *p = (uint8_t *)zero + offset;
+    Umjit_Program_T *prog = umjit_compile(image, len);
+    if (prog == NULL)
+        return -1;
 
-    /* rA = m[rB][rC]*/
-
-    /* lea (%rcx, %rBd, 1), %rax */
-    *p++ = 0x4a;
-    *p++ = 0x8d;
-    *p++ = 0x04;
-    *p++ = 0x01 | (b << 3);
+    return adopt(vm, prog);
+}
 
-    /* mov %rAd, (%rax, %rCd,4) */
-    *p++ = 0x46;
-    *p++ = 0x8B;
-    *p++ = 0x04 | (a << 3);
-    *p++ = 0x80 | (c << 3);
+int umjit_load_file(Umjit_T *vm, const char *path)
+{
+    Umjit_Program_T *prog = umjit_compile_file(path);
+    if (prog == NULL)
+        return -1;
 
-    /* No Ops */
-    *p++ = 0x90;
-    *p++ = 0x90;
+    return adopt(vm, prog);
+}
 
-    return CHUNK;
+int umjit_reset(Umjit_T *vm)
+{
+    if (indirect_mode)
+        return -1;
+
+    release_loaded_code(vm);
+    retier(vm, vm->program->image, vm->program->words, false);
+    vs_reset(vs_context(vm->umem));
+    load_zero_segment(vm);
+
+    memset(vm->m.regs, 0, sizeof(vm->m.regs));
+    vm->m.pc = 0;
+    vm->m.status = 0;
+    vm->ran = false;
+    return 0;
 }
 
-size_t seg_store(void *zero, size_t offset, unsigned a, unsigned b, unsigned c)
+/* A snapshot is a Snap_T, the program image, then the memory system */
+#define SNAP_MAGIC "UMSNAP01"
+#define SNAP_MAGIC_LEN 8
+
+typedef struct
+{
+    char magic[SNAP_MAGIC_LEN];
+    uint32_t regs[8];
+    uint32_t pc;
+    uint32_t status;
+    uint32_t loaded;  /* Running code from a Load Program, not the image */
+    uint32_t words;   /* In the image */
+} Snap_T;
+
+int umjit_snapshot(Umjit_T *vm, const char *path)
 {
-    uint8_t *p = (uint8_t *)zero + offset;
+    if (indirect_mode || vm->program == NULL)
+        return -1;
 
-    /* m[rA][rB] = rC */
+    FILE *fp = fopen(path, "w+b");
+    if (fp == NULL)
+        return -1;
+
+    Snap_T snap;
+    memcpy(snap.magic, SNAP_MAGIC, SNAP_MAGIC_LEN);
+    memcpy(snap.regs, vm->m.regs, sizeof(snap.regs));
+    snap.pc = vm->m.pc;
+    snap.status = vm->m.status;
+    snap.loaded = vm->m.code != vm->program->code;
+    snap.words = vm->program->words;
+
+    bool ok = fwrite(&snap, sizeof(snap), 1, fp) == 1 &&
+              fwrite(vm->program->image, sizeof(uint32_t), snap.words, fp) ==
+                  snap.words &&
+              vs_snapshot(vs_context(vm->umem), fp);
+
+    return (fclose(fp) == 0 && ok) ? 0 : -1;
+}
 
-    /* lea (%rcx, %rBd, 1), %rax */
-    *p++ = 0x4a;
-    *p++ = 0x8d;
-    *p++ = 0x04;
-    *p++ = 0x01 | (a << 3);
+int umjit_restore(Umjit_T *vm, const char *path)
+{
+    if (indirect_mode)
+        return -1;
 
-    /* mov (%rax, %rBd, 4), %rCd */
-    *p++ = 0x46;
-    *p++ = 0x89;
-    *p++ = 0x04 | (c << 3);
-    *p++ = 0x80 | (b << 3);
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return -1;
 
-    /* Super hacky method for handling recompile: use the output of the lea
-     * instruction as an else case: the Virt32 memory allocator always
-     * allocates along 32-byte boundaries, which means that the lower 5 bits
-     * will always be 0. This means that with opcodes 1-31 will be safe to use
-     * for special cases, and the 0 or >32 opcodes can be used for the recompile
-     * instruction. */
-    if (SELF_MODIFYING) {
-        /* Unconditionally branch to the handler
-         * This is super inefficient, and has been implemented somewhat as an
-         * afterthought. */
-        *p++ = 0xff;
-        *p++ = 0xd3;
+    Snap_T snap;
+    if (fread(&snap, sizeof(snap), 1, fp) != 1 ||
+        memcmp(snap.magic, SNAP_MAGIC, SNAP_MAGIC_LEN) != 0 ||
+        snap.words > (KERN_RESERVE - BOOK_SIZE) / sizeof(uint32_t))
+    {
+        fclose(fp);
+        return -1;
     }
 
-    else {
-        /* 2 No Ops */
-        *p++ = 0x90;
-        *p++ = 0x90;
+    uint32_t *words = malloc((size_t)snap.words * sizeof(uint32_t) + 1);
+    assert(words != NULL);
+    if (fread(words, sizeof(uint32_t), snap.words, fp) != snap.words)
+    {
+        free(words);
+        fclose(fp);
+        return -1;
     }
 
-    return CHUNK;
-}
-
-size_t add_regs(void *zero, size_t offset, unsigned a, unsigned b, unsigned c)
-{
-    uint8_t *p = (uint8_t *)zero + offset;
-
-    /* rA = rB + rC % 2^32 */
-    /* mov %rBd, %eax */
-    *p++ = 0x44;
-    *p++ = 0x89;
-    *p++ = 0xC0 | (b << 3);
-
-    /* add %rCd, %eax */
-    *p++ = 0x44;
-    *p++ = 0x01;
-    *p++ = 0xC0 | (c << 3);
+    /* Start from an empty memory system, then lay the snapshot over it */
+    release_program(vm);
+    Mem_T *mem = vs_context(vm->umem);
+    vs_reset(mem);
+    bool ok = vs_restore(mem, fp);
+    fclose(fp);
 
-    /* mov %eax, %rAd */
-    *p++ = 0x41;
-    *p++ = 0x89;
-    *p++ = 0xC0 | a;
+    vm->program = compile_words(words, snap.words);
+    vm->owns_program = true;
+    vm->m.code = vm->program->code;
+    retier(vm, words, snap.words, false);
+    if (!ok)
+    {
+        umjit_reset(vm);
+        return -1;
+    }
 
-    /* No Op */
-    *p++ = 0x90;
+    /* Code from a Load Program is compiled again from the zero segment */
+    if (snap.loaded)
+    {
+        uint32_t *kern = convert_address(vm->umem, 0);
+        install_code(vm, (uint8_t *)kern, kern[-1] / sizeof(uint32_t));
+    }
 
-    return CHUNK;
+    memcpy(vm->m.regs, snap.regs, sizeof(snap.regs));
+    vm->m.pc = snap.pc;
+    vm->m.status = snap.status;
+    vm->ran = true;
+    return 0;
 }
 
+/* An AOT executable is the JIT's own executable, then the compiled code on
+ * a page of its own, then the image, then an Aot_T */
+#define AOT_MAGIC "UMAOT002"
+#define AOT_MAGIC_LEN 8
+#define AOT_PAGE 4096
 
-size_t mult_regs(void *zero, size_t offset, unsigned a, unsigned b, unsigned c)
+typedef struct
 {
-    uint8_t *p = (uint8_t *)zero + offset;
-
-    /* mov %rBd, %eax */
-    *p++ = 0x44;
-    *p++ = 0x89;
-    *p++ = 0xC0 | (b << 3);
-
-    /* mul %rCd, %eax */
-    *p++ = 0x41;
-    *p++ = 0xF7;
-    *p++ = 0xE0 | c;
+    char magic[AOT_MAGIC_LEN];
+    uint64_t code_off;
+    uint64_t code_size;
+    uint64_t image_off;
+    uint32_t words;
+    uint32_t chunk;
+    uint32_t features; /* What the code needs of the CPU, from lower.h */
+    uint32_t pad;
+} Aot_T;
+
+static bool copy_file(FILE *in, FILE *out)
+{
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+        if (fwrite(buf, 1, n, out) != n)
+            return false;
 
-    /* mov %eax, %rAd */
-    *p++ = 0x41;
-    *p++ = 0x89;
-    *p++ = 0xC0 | a;
+    return !ferror(in);
+}
 
-    /* No Op */
-    *p++ = 0x90;
+int umjit_aot(Umjit_Program_T *prog, const char *path)
+{
+    if (indirect_mode)
+        return -1;
 
-    return CHUNK;
-}
+    FILE *exe = fopen("/proc/self/exe", "rb");
+    if (exe == NULL)
+        return -1;
 
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+        fclose(exe);
+        return -1;
+    }
 
-size_t div_regs(void *zero, size_t offset, unsigned a, unsigned b, unsigned c)
-{
-    uint8_t *p = (uint8_t *)zero + offset;
+    bool ok = copy_file(exe, fp);
+    fclose(exe);
 
-    /* xor %edx, %edx */
-    *p++ = 0x31;
-    *p++ = 0xd2;
+    Aot_T aot;
+    memcpy(aot.magic, AOT_MAGIC, AOT_MAGIC_LEN);
+    aot.code_size = prog->code_size;
+    aot.words = prog->words;
+    aot.chunk = CHUNK;
+    aot.features = lower_features();
+    aot.pad = 0;
 
-    /* Put the dividend (register b) in %eax */
-    /* mov %rBd, %eax */
-    *p++ = 0x44;
-    *p++ = 0x89;
-    *p++ = 0xC0 | (b << 3);
+    /* The code is mapped straight from the file, so it starts on a page */
+    long end = ftell(fp);
+    aot.code_off = (end + AOT_PAGE - 1) / AOT_PAGE * AOT_PAGE;
+    aot.image_off = aot.code_off + aot.code_size;
 
-    /* div %rC, %rax */
-    *p++ = 0x49;
-    *p++ = 0xF7;
-    *p++ = 0xF0 | c;
+    ok = ok && end >= 0 && fseek(fp, aot.code_off, SEEK_SET) == 0 &&
+         fwrite(prog->code, 1, aot.code_size, fp) == aot.code_size &&
+         fwrite(prog->image, sizeof(uint32_t), aot.words, fp) == aot.words &&
+         fwrite(&aot, sizeof(aot), 1, fp) == 1;
 
-    /* Exchange %eax with the target destination register */
-    /* xchg %eax, %rAd */
-    *p++ = 0x41;
-    *p++ = 0x90 | a;
+    if (fclose(fp) != 0 || !ok || chmod(path, 0755) != 0)
+    {
+        remove(path);
+        return -1;
+    }
 
-    return CHUNK;
+    return 0;
 }
 
-size_t nand_regs(void *zero, size_t offset, unsigned a, unsigned b, unsigned c)
+Umjit_Program_T *umjit_embedded(void)
 {
-    uint8_t *p = (uint8_t *)zero + offset;
-
-    /* Thank you to Tom Hebb for figuring out this clever approach for saving a
-     * an instruction.
-     * When r1 = r0 NAND r1, or r1 = r1 NAND r0, we want to use the source
-     * register that is the same as the destination register as the destination,
-     * and be sure to avoid clobbering the other source register. 
-     * For instructions where all 3 registers are the same or are different,
-     * this is not a concern.
-     */
-
-    unsigned move, keep;
-    if (a == c) {
-        move = c;
-        keep = b;
+    int fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    Aot_T aot;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(aot) ||
+        pread(fd, &aot, sizeof(aot), st.st_size - sizeof(aot)) !=
+            sizeof(aot) ||
+        memcmp(aot.magic, AOT_MAGIC, AOT_MAGIC_LEN) != 0 ||
+        aot.chunk != CHUNK || aot.code_off % AOT_PAGE != 0 ||
+        aot.image_off + (uint64_t)aot.words * sizeof(uint32_t) + sizeof(aot) !=
+            (uint64_t)st.st_size)
+    {
+        close(fd);
+        return NULL;
     }
 
-    else {
-        move = b;
-        keep = c;
+    size_t image_bytes = (size_t)aot.words * sizeof(uint32_t);
+    uint32_t *words = malloc(image_bytes + 1);
+    assert(words != NULL);
+
+    /* Code built for a CPU feature this one lacks is compiled again */
+    bool native = (aot.features & ~lower_features()) == 0;
+
+    /* Code that may be recompiled gets a private, writable copy */
+    int prot = PROT_READ | PROT_EXEC | (SELF_MODIFYING ? PROT_WRITE : 0);
+    void *code = aot.code_size == 0 || !native
+                     ? NULL
+                     : mmap(NULL, aot.code_size, prot, MAP_PRIVATE, fd,
+                            aot.code_off);
+    bool ok = code != MAP_FAILED &&
+              pread(fd, words, image_bytes, aot.image_off) ==
+                  (ssize_t)image_bytes;
+    close(fd);
+
+    if (!ok)
+    {
+        if (code != MAP_FAILED && code != NULL)
+            munmap(code, aot.code_size);
+        free(words);
+        return NULL;
     }
 
+    if (!native)
+        return compile_words(words, aot.words);
 
-    /* mov %(Move register), %rAd, */
-    *p++ = 0x45;
-    *p++ = 0x8b;
-    *p++ = 0xc0 | (a << 3) | move;
-
-    /* and %(Keep register), %rAd */
-    *p++ = 0x45;
-    *p++ = 0x23;
-    *p++ = 0xc0 | (a << 3) | keep;
-
-    /* not %rAd */
-    *p++ = 0x41;
-    *p++ = 0xf7;
-    *p++ = 0xd0 | a;
-
-    /* No Op */
-    *p++ = 0x90;
-
-    return CHUNK;
+    Umjit_Program_T *prog = malloc(sizeof(Umjit_Program_T));
+    assert(prog != NULL);
+    prog->image = words;
+    prog->words = aot.words;
+    prog->code = code;
+    prog->code_size = aot.code_size;
+    return prog;
 }
 
-size_t handle_halt(void *zero, size_t offset)
+int umjit_run_budget(Umjit_T *vm, uint64_t jumps)
 {
-    uint8_t *p = (uint8_t *)zero + offset;
-
-    /* Move the Halt opcode into %al */
-    /* mov imm8, %al */
-    *p++ = 0xb0;
-    *p++ = 0x00 | OP_HALT;
+    assert(vm->program != NULL);
 
-    /* Jump to large op function address (NOTE: jump, not call) */
-    /* jmp *%rbx */
-    *p++ = 0xff;
-    *p++ = 0xe3;
+    if (vm->m.status == MACHINE_HALTED || vm->m.status == UMJIT_KILLED)
+        return vm->m.status;
+    if (jumps == 0)
+        return UMJIT_OUT_OF_FUEL;
 
-    return CHUNK;
+    vm->m.fuel = jumps;
+    vm->ran = true;
+    return run(&vm->m);
 }
 
-uint32_t map_segment(uint32_t size, uint8_t *umem)
+int umjit_status(Umjit_T *vm)
 {
-    uint32_t mapped = vs_calloc(umem, size * sizeof(uint32_t));
-    return mapped;
+    return vm->m.status;
 }
 
-size_t inject_map_segment(void *zero, size_t offset, unsigned b, unsigned c)
+void umjit_kill(Umjit_T *vm)
 {
-    uint8_t *p = (uint8_t *)zero + offset;
+    vm->m.status = UMJIT_KILLED;
+}
 
-    /* Move register c to be the function call argument */
-    /* mov %rCd, %edi */
-    *p++ = 0x44;
-    *p++ = 0x89;
-    *p++ = 0xc7 | (c << 3);
-    
-    /* Move the Map opcode into %al */
-    /* mov imm8, %al */
-    *p++ = 0xb0;
-    *p++ = 0x00 | OP_MAP;
+int umjit_run_static(Umjit_T *vm, Static_Fn fn)
+{
+    assert(vm->program != NULL);
 
-    /* Call the large op function handler */
-    /* call *%rbx */
-    *p++ = 0xff;
-    *p++ = 0xd3;
+    if (vm->m.status == MACHINE_HALTED || vm->m.status == UMJIT_KILLED)
+        return vm->m.status;
 
-    /* Move return value from %rax to register b */
-    /* mov %rax, %rBd */
-    *p++ = 0x41;
-    *p++ = 0x89;
-    *p++ = 0xc0 | b;
+    /* The translation only covers the original program */
+    if (!indirect_mode && vm->m.code == vm->program->code)
+    {
+        vm->ran = true;
+        vm->m.status = fn(&vm->m);
+        if (vm->m.status != 0)
+            return vm->m.status;
+    }
 
-    return CHUNK;
+    return umjit_run(vm);
 }
 
-void unmap_segment(uint32_t segment)
+int umjit_run(Umjit_T *vm)
 {
-    vs_free(segment);
+    /* Fuel this large never runs out */
+    return umjit_run_budget(vm, UINT64_MAX);
 }
 
-size_t inject_unmap_segment(void *zero, size_t offset, unsigned c)
+/* Put the VM's program in the zero segment */
+void load_zero_segment(Umjit_T *vm)
 {
-    uint8_t *p = (uint8_t *)zero + offset;
-
-    /* Move register c to be the function argument */
-    /* mov %rCd, %edi */
-    *p++ = 0x44;
-    *p++ = 0x89;
-    *p++ = 0xc7 | (c << 3);
-
-    /* Move the Unmap opcode into %al */
-    /* mov imm8, %al */
-    *p++ = 0xb0;
-    *p++ = 0x00 | OP_UNMAP;
-
-    /* Call the large op function handler */
-    /* call *%rbx */
-    *p++ = 0xff;
-    *p++ = 0xd3;
-
-    /* No Op */
-    *p++ = 0x0F;
-    *p++ = 0x1F;
-    *p++ = 0x00;
+    size_t bytes = (size_t)vm->program->words * sizeof(uint32_t);
+    uint8_t *kern;
+    if (indirect_mode)
+        kern = hs_kern_realloc(bytes);
+    else
+        kern = convert_address(vm->umem,
+                               kern_realloc(vs_context(vm->umem), bytes));
 
-    return CHUNK;
+    memcpy(kern, vm->program->image, bytes);
 }
 
-size_t print_reg(void *zero, size_t offset, unsigned c)
+uint32_t map_segment(uint32_t size, uint8_t *umem, size_t code_offset)
 {
-    uint8_t *p = (uint8_t *)zero + offset;
+    /* code_offset points into the slot of the Map instruction */
+    uint32_t pc = code_offset / CHUNK;
+    uint32_t mapped;
+
+    /* From 2^30 words up the size in bytes no longer fits in 32 bits, and no
+     * segment that big fits in the arena anyway */
+    uint64_t bytes = (uint64_t)size * sizeof(uint32_t);
+    if (bytes > (indirect_mode ? MAX_HANDLE_SEGMENT : MAX_SEGMENT))
+    {
+        fprintf(stderr, "Error: Segment of %u words is too large to map\n",
+                size);
+        exit(EXIT_FAILURE);
+    }
 
-    /* Move register c to be the function argument */
-    /* mov %rCd, %edi */
-    *p++ = 0x44;
-    *p++ = 0x89;
-    *p++ = 0xc7 | (c << 3);
+    if (indirect_mode)
+        mapped = hs_calloc(bytes);
+    else
+    {
+        if (stats_enabled)
+            stats_site(pc, bytes);
+        mapped = vs_calloc(vs_context(umem), bytes);
+    }
 
-    /* Move the Print Out opcode into %al */
-    /* mov imm8, %al */
-    *p++ = 0xb0;
-    *p++ = 0x00 | OP_OUT;
+    if (trace_enabled)
+        trace_map(pc, bytes, mapped);
+    return mapped;
+}
 
-    /* Call the large op function handler */
-    /* call *%rbx */
-    *p++ = 0xff;
-    *p++ = 0xd3;
 
-    /* No Op */
-    *p++ = 0x0F;
-    *p++ = 0x1F;
-    *p++ = 0x00;
+void unmap_segment(uint32_t segment, uint8_t *umem, size_t code_offset)
+{
+    if (trace_enabled)
+        trace_unmap(code_offset / CHUNK, segment);
 
-    return CHUNK;
+    if (indirect_mode)
+        hs_free(segment);
+    else
+        vs_free(vs_context(umem), segment);
 }
 
-size_t read_into_reg(void *zero, size_t offset, unsigned c)
-{
-    uint8_t *p = (uint8_t *)zero + offset;
-
-    /* Move the Read In opcode into %al */
-    /* mov imm8, %al */
-    *p++ = 0xb0;
-    *p++ = 0x00 | OP_IN;
 
-    /* Call the large op function handler */
-    /* call *%rbx */
-    *p++ = 0xff;
-    *p++ = 0xd3;
+/* The machine is the first member of its VM */
+void print_out(uint32_t x, Machine_T *m)
+{
+    Umjit_T *vm = (Umjit_T *)m;
+    vm->io.put((uint8_t)x, vm->io.cl);
+}
 
-    /* Store the result in register c */
-    /* mov %eax, %rCd */
-    *p++ = 0x41;
-    *p++ = 0x89;
-    *p++ = 0xC0 | c;
+/* Negative when the VM has to wait for input */
+int64_t read_char(Machine_T *m)
+{
+    Umjit_T *vm = (Umjit_T *)m;
+    int c = vm->io.get(vm->io.cl);
 
-    /* No Op */
-    *p++ = 0x0F;
-    *p++ = 0x1F;
-    *p++ = 0x00;
+    /* End of input reads as all ones */
+    if (c == UMJIT_WOULD_BLOCK)
+        return -1;
+    return c == EOF ? (int64_t)0xFFFFFFFF : c;
+}
 
-    return CHUNK;
+/* Control reached a PC past the end of the zero segment, by a jump or by
+ * running off its last instruction */
+void past_end(Machine_T *m, uint32_t pc)
+{
+    fprintf(stderr, "Error: PC %u is past the end of the %u word program\n",
+            pc, m->words);
+    exit(EXIT_FAILURE);
 }
 
-void *load_program(uint32_t b_val, uint8_t *umem)
+void *load_program(uint32_t b_val, uint8_t *umem, Machine_T *m)
 {
     /* Ensure the segment we are loading is not the zero segment */
     assert(b_val != 0);
 
     /* Get the size of the segment we want to duplicate */
-    uint32_t *seg_addr = (uint32_t *)convert_address(umem, b_val);
+    uint32_t *seg_addr;
+    if (indirect_mode)
+        seg_addr = (uint32_t *)handles[b_val];
+    else
+        seg_addr = (uint32_t *)convert_address(umem, b_val);
     uint32_t copy_size = seg_addr[-1];
 
     uint32_t num_words = copy_size / sizeof(uint32_t);
 
     /* Reallocate the kernel size and copy the new segment into it */
-    kern_realloc(copy_size);
-    kern_memcpy(b_val, copy_size);
-
-    /* Allocate new exectuable memory for the segment being mapped
-     * Note that copy size is in bytes, not words*/
-    void *new_zero = mmap(NULL, num_words * CHUNK,
-                          PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    memset(new_zero, 0, num_words * CHUNK);
-
-    /* Compile the segment being mapped into machine instructions */
-    uint32_t offset = 0;
-    for (uint32_t i = 0; i < num_words; i++)
+    uint8_t *kern;
+    if (indirect_mode)
     {
-        uint32_t curr_word = get_at(umem, i * sizeof(uint32_t));
-        offset = compile_instruction(new_zero, curr_word, offset);
+        kern = hs_kern_realloc(copy_size);
+        memcpy(kern, seg_addr, copy_size);
+    }
+    else
+    {
+        Mem_T *mem = vs_context(umem);
+        kern = convert_address(umem, kern_realloc(mem, copy_size));
+        kern_memcpy(mem, b_val, copy_size);
     }
 
-    int result = mprotect(new_zero, num_words * CHUNK, PROT_READ | PROT_EXEC);
-    assert(result == 0);
-
-    return new_zero;
+    install_code((Umjit_T *)m, kern, num_words);
+    return m->code;
 }
 
-size_t inject_load_program(void *zero, size_t offset, unsigned b, unsigned c)
+/* Compile a segment into fresh executable memory */
+static void *compile_segment(uint8_t *kern, uint32_t num_words, size_t *size)
 {
-    uint8_t *p = (uint8_t *)zero + offset;
-
-    /* mov %rCd, %esi (updating the program counter) */
-    *p++ = 0x44;
-    *p++ = 0x89;
-    *p++ = 0xc6 | (c << 3);
+    /* Compile the segment being mapped into machine instructions */
+    void *new_zero = lower_segment((uint32_t *)kern, num_words, size);
+    if (new_zero == NULL)
+        return NULL;
 
-    /* mov %rBd, %edi (to test with a known register in assembly)*/
-    *p++ = 0x44;
-    *p++ = 0x89;
-    *p++ = 0xc7 | (b << 3);
+    int result = mprotect(new_zero, *size, PROT_READ | PROT_EXEC);
+    assert(result == 0);
 
-    /* Move the Duplicate segment opcode into %al */
-    /* mov imm8, %al */
-    *p++ = 0xb0;
-    *p++ = 0x00 | OP_DUPLICATE;
+    if (cache_enabled)
+        cache_store((uint32_t *)kern, num_words, indirect_mode, new_zero,
+                    *size);
 
-    /* jump to load program function address (NOTE: jump, not call) */
-    /* jmp *%rbx */
-    *p++ = 0xff;
-    *p++ = 0xe3;
+    return new_zero;
+}
 
-    return CHUNK;
+/* Compile what is now in the zero segment and make it the VM's code */
+static void install_code(Umjit_T *vm, uint8_t *kern, uint32_t num_words)
+{
+    void *new_zero = NULL;
+    size_t size = 0;
+    if (cache_enabled && num_words > 0)
+        new_zero = cache_lookup((uint32_t *)kern, num_words, indirect_mode,
+                                &size);
+    if (new_zero == NULL)
+        new_zero = compile_segment(kern, num_words, &size);
+
+    /* The code being replaced is no longer reachable */
+    release_loaded_code(vm);
+    vm->m.code = new_zero;
+    vm->code_size = size;
+    retier(vm, (uint32_t *)kern, num_words, true);
 }
+
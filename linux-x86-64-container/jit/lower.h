@@ -0,0 +1,59 @@
+#ifndef LOWER_H
+#define LOWER_H
+
+/* Lowering of the IR (see ir.h) to x86-64, in x86.c.
+ * Compiled code starts with a slot of CHUNK bytes for every word of the
+ * segment, which is where jumps land: the dispatcher finds PC p at p * CHUNK.
+ * After the slots come the blocks, each lowered straight through with no
+ * padding, and the slot at the start of a block jumps to it. Control that
+ * enters a block anywhere else runs the slots. Instructions that call out
+ * stay in their slots, since the handlers work out the PC from the return
+ * address, so a block that ends in one jumps back to its slot. Between the
+ * slots and the blocks, END_SLOT bytes take a program that runs off its last
+ * word to the dispatcher, which fails the machine. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "ir.h"
+
+/* Set this to 1 to handle recompiling. This flag will majorly throttle the
+ * segmented store instruction by design: the entire program was designed around
+ * the assumption this feature would not be implemented. */
+#define SELF_MODIFYING 0
+
+#define END_SLOT 11
+
+/* Set by -i: segment IDs index the handle table instead of the Virt32 arena */
+extern bool indirect_mode;
+
+/* Compile n words into fresh writable memory, and set *size to its length.
+ * NULL for no words. */
+uint8_t *lower_segment(const uint32_t *words, uint32_t n, size_t *size);
+
+/* The CPU features beyond baseline x86-64 that compiled code may use on this
+ * machine, as LOWER_ bits. Code compiled where one is present cannot run
+ * where it is not, so cached code and AOT executables record them. */
+#define LOWER_BMI 1 /* andn */
+
+uint32_t lower_features(void);
+
+/* A path the tracing tier recorded (see tracer.h): the pieces of code it ran
+ * through, in order. Each piece runs straight on into the next, or ends in
+ * the Load Program that jumped there, with the target it took as its value. */
+typedef struct
+{
+    Ir_Block *pieces;
+    uint32_t count;
+    bool loops;    /* The last piece jumps back to the start of the first */
+    uint32_t exit; /* Otherwise, the PC the path runs on to */
+} Path_T;
+
+/* Compile a path into a function for the tier's entries (see tier.h), in
+ * memory from malloc to be copied where it can run, and set *size to its
+ * length. Each Load Program on it checks it is going where it went before
+ * and spends its fuel; where not, the function returns to the dispatcher,
+ * which goes on in the slots. */
+uint8_t *lower_path(const Path_T *path, size_t *size);
+
+#endif
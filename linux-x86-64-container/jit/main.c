@@ -0,0 +1,195 @@
+/**
+ * @file main.c
+ * @brief
+ * The command line front end of the JIT: runs one .um program on stdin and
+ * stdout through libumjit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "umjit.h"
+#include "stats.h"
+#include "trace.h"
+
+/* Input for -c: none, so the program stops at its first Input */
+static int no_input(void *cl)
+{
+    (void)cl;
+    return UMJIT_WOULD_BLOCK;
+}
+
+static void to_stdout(uint8_t c, void *cl)
+{
+    (void)cl;
+    putchar(c);
+}
+
+/* An executable made with -a runs the program it carries on stdin and
+ * stdout, whatever its arguments */
+static int run_embedded(Umjit_Program_T *prog)
+{
+    Umjit_T *vm = umjit_new();
+    umjit_use(vm, prog);
+    umjit_run(vm);
+    umjit_free(&vm);
+    umjit_program_free(&prog);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    Umjit_Program_T *embedded = umjit_embedded();
+    if (embedded != NULL)
+        return run_embedded(embedded);
+
+    int opt;
+    bool bad_usage = false;
+    bool indirect = false;
+    const char *trace_path = NULL;
+    const char *fork_path = NULL;
+    const char *snap_path = NULL;
+    bool restore = false;
+    const char *aot_path = NULL;
+    bool optimize = false;
+    bool tracing = false;
+    const char *cache_dir = NULL;
+    const char *cache_name = NULL;
+    while ((opt = getopt(argc, argv, "ist:f:c:rk:K:a:OT")) != -1)
+    {
+        if (opt == 'i')
+            indirect = true;
+        else if (opt == 's')
+            stats_enabled = true;
+        else if (opt == 't')
+            trace_path = optarg;
+        else if (opt == 'f')
+            fork_path = optarg;
+        else if (opt == 'c')
+            snap_path = optarg;
+        else if (opt == 'r')
+            restore = true;
+        else if (opt == 'k')
+            cache_dir = optarg;
+        else if (opt == 'K')
+            cache_name = optarg;
+        else if (opt == 'a')
+            aot_path = optarg;
+        else if (opt == 'O')
+            optimize = true;
+        else if (opt == 'T')
+            tracing = true;
+        else
+            bad_usage = true;
+    }
+
+    /* Statistics describe the Virt32 allocator, which -i bypasses */
+    if (indirect && stats_enabled)
+        bad_usage = true;
+
+    /* Forked children would share one report and one trace */
+    if (fork_path != NULL && (stats_enabled || trace_path != NULL))
+        bad_usage = true;
+
+    /* The handle table cannot be snapshotted */
+    if (indirect && (snap_path != NULL || restore))
+        bad_usage = true;
+
+    /* One tier at a time */
+    if (optimize && tracing)
+        bad_usage = true;
+
+    /* Ahead-of-time compilation only compiles, and only in direct mode */
+    if (aot_path != NULL && (indirect || restore || snap_path != NULL ||
+                             fork_path != NULL))
+        bad_usage = true;
+
+    if (bad_usage || optind != argc - 1)
+    {
+        fprintf(stderr,
+                "Usage: ./um [-i | -s] [-O | -T] [-t trace | -f socket] "
+                "[-c snapshot | -a executable] [-k cache] [-K shm] "
+                "[executable.um | -r snapshot]\n");
+        return EXIT_FAILURE;
+    }
+
+    if (indirect)
+        umjit_use_indirect();
+    if (optimize && umjit_use_tier() != 0)
+    {
+        fprintf(stderr, "The optimizing tier is not available (see tier.h).\n");
+        return EXIT_FAILURE;
+    }
+    if (tracing)
+        umjit_use_tracer();
+    if (cache_dir != NULL)
+        umjit_use_cache(cache_dir);
+    if (cache_name != NULL)
+        umjit_share_cache(cache_name);
+    if (trace_path != NULL)
+        trace_open(trace_path);
+
+    const char *path = argv[optind];
+    if (aot_path != NULL)
+    {
+        Umjit_Program_T *prog = umjit_compile_file(path);
+        if (prog == NULL)
+        {
+            fprintf(stderr, "File %s could not be opened.\n", path);
+            return EXIT_FAILURE;
+        }
+
+        int written = umjit_aot(prog, aot_path);
+        umjit_program_free(&prog);
+        if (written != 0)
+        {
+            fprintf(stderr, "Executable %s could not be written.\n",
+                    aot_path);
+            return EXIT_FAILURE;
+        }
+
+        return 0;
+    }
+
+    Umjit_T *vm = umjit_new();
+
+    int loaded = restore ? umjit_restore(vm, path) : umjit_load_file(vm, path);
+    if (loaded != 0)
+    {
+        fprintf(stderr, "File %s could not be opened.\n", path);
+        return EXIT_FAILURE;
+    }
+
+    /* Run up to the first Input and save the VM there */
+    if (snap_path != NULL)
+    {
+        umjit_set_io(vm, (Umjit_IO){no_input, to_stdout, NULL});
+        umjit_run(vm);
+        if (umjit_snapshot(vm, snap_path) != 0)
+        {
+            fprintf(stderr, "Snapshot %s could not be written.\n", snap_path);
+            return EXIT_FAILURE;
+        }
+
+        umjit_free(&vm);
+        if (trace_enabled)
+            trace_close();
+        return 0;
+    }
+
+    if (fork_path != NULL)
+    {
+        umjit_fork_server(vm, fork_path);
+        fprintf(stderr, "Socket %s could not be opened.\n", fork_path);
+        return EXIT_FAILURE;
+    }
+
+    umjit_run(vm);
+    umjit_free(&vm);
+
+    if (trace_enabled)
+        trace_close();
+
+    return 0;
+}
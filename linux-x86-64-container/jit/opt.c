@@ -0,0 +1,349 @@
+/**
+ * @file opt.c
+ * @brief
+ * Passes over IR blocks (see opt.h). They know nothing of the machine the
+ * block is lowered to.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "opt.h"
+
+#define BIT(r) (1u << (r))
+
+static Ir_Insn op_nop(void)
+{
+    return (Ir_Insn){.op = IR_NOP};
+}
+
+static Ir_Insn op_const(unsigned a, uint32_t value)
+{
+    return (Ir_Insn){.op = IR_CONST, .a = a, .def = BIT(a), .value = value};
+}
+
+/* rA = rB op value */
+static Ir_Insn op_unary(uint8_t op, unsigned a, unsigned b, uint32_t value)
+{
+    return (Ir_Insn){.op = op, .a = a, .b = b, .def = BIT(a), .use = BIT(b),
+                     .value = value};
+}
+
+/* rA = rB op rC */
+static Ir_Insn op_binary(uint8_t op, unsigned a, unsigned b, unsigned c)
+{
+    return (Ir_Insn){.op = op, .a = a, .b = b, .c = c, .def = BIT(a),
+                     .use = BIT(b) | BIT(c)};
+}
+
+/* The shift that multiplies by v, or -1 if v is not a power of 2 */
+static int shift_of(uint32_t v)
+{
+    if (v == 0 || (v & (v - 1)) != 0)
+        return -1;
+
+    int s = 0;
+    while (v >>= 1)
+        s++;
+    return s;
+}
+
+static Ir_Insn add(unsigned a, unsigned b, uint32_t k)
+{
+    return k == 0 ? op_unary(IR_MOV, a, b, 0) : op_unary(IR_ADDK, a, b, k);
+}
+
+static Ir_Insn multiply(unsigned a, unsigned b, uint32_t k)
+{
+    if (k == 0)
+        return op_const(a, 0);
+    return k == 1 ? op_unary(IR_MOV, a, b, 0) : op_unary(IR_MULK, a, b, k);
+}
+
+static Ir_Insn divide(unsigned a, unsigned b, uint32_t k)
+{
+    int s = shift_of(k);
+    if (s == 0)
+        return op_unary(IR_MOV, a, b, 0);
+    return s > 0 ? op_unary(IR_SHR, a, b, s) : op_unary(IR_DIVK, a, b, k);
+}
+
+void opt_constants(Ir_Block *block)
+{
+    bool known[8] = {false};
+    uint32_t value[8] = {0};
+
+    for (uint32_t i = 0; i < block->n; i++)
+    {
+        Ir_Insn *in = &block->insns[i];
+        unsigned a = in->a, b = in->b, c = in->c;
+        bool kb = known[b], kc = known[c];
+        uint32_t vb = value[b], vc = value[c];
+
+        switch (in->op)
+        {
+        case IR_CMOV:
+            if (kc && vc == 0)
+                *in = op_nop();
+            else if (kc)
+                *in = kb ? op_const(a, vb) : op_unary(IR_MOV, a, b, 0);
+            break;
+        case IR_ADD:
+            if (kb && kc)
+                *in = op_const(a, vb + vc);
+            else if (kb || kc)
+                *in = add(a, kb ? c : b, kb ? vb : vc);
+            break;
+        case IR_MUL:
+            if (kb && kc)
+                *in = op_const(a, vb * vc);
+            else if (kb || kc)
+                *in = multiply(a, kb ? c : b, kb ? vb : vc);
+            break;
+        case IR_DIV:
+            /* Division by zero is left to fail as it would have */
+            if (kc && vc != 0)
+                *in = kb ? op_const(a, vb / vc) : divide(a, b, vc);
+            break;
+        case IR_NAND:
+            if (kb && kc)
+                *in = op_const(a, ~(vb & vc));
+            break;
+        default:
+            break;
+        }
+
+        /* What the instruction, as rewritten, leaves known */
+        if (in->op == IR_CONST)
+        {
+            known[in->a] = true;
+            value[in->a] = in->value;
+        }
+        else if (in->op == IR_MOV)
+        {
+            known[in->a] = known[in->b];
+            value[in->a] = value[in->b];
+        }
+        else
+        {
+            for (unsigned r = 0; r < 8; r++)
+                if (in->def & BIT(r))
+                    known[r] = false;
+        }
+    }
+}
+
+/* The NAND that last wrote each register, if one did, and the operands it
+ * read. It still says what is in the register until one of them is written. */
+typedef struct
+{
+    bool nand[8];
+    uint8_t b[8], c[8];
+    uint32_t vb[8], vc[8];
+    uint32_t version[8]; /* Writes to each register so far */
+} Nands_T;
+
+static bool is_nand(const Nands_T *n, unsigned r, unsigned *b, unsigned *c)
+{
+    if (!n->nand[r] || n->version[n->b[r]] != n->vb[r] ||
+        n->version[n->c[r]] != n->vc[r])
+        return false;
+
+    *b = n->b[r];
+    *c = n->c[r];
+    return true;
+}
+
+static bool is_not(const Nands_T *n, unsigned r, unsigned *x)
+{
+    unsigned c;
+    return is_nand(n, r, x, &c) && *x == c;
+}
+
+/* Whether ~(b & c) is x ^ y, the way it is built from four NANDs */
+static bool is_xor(const Nands_T *n, unsigned b, unsigned c, unsigned *x,
+                   unsigned *y)
+{
+    /* b = ~(x & t) and c = ~(y & t) with t = ~(x & y), in any order */
+    unsigned b1, b2, c1, c2;
+    if (!is_nand(n, b, &b1, &b2) || !is_nand(n, c, &c1, &c2))
+        return false;
+
+    unsigned bt[2][2] = {{b1, b2}, {b2, b1}}, ct[2][2] = {{c1, c2}, {c2, c1}};
+    for (int i = 0; i < 2; i++)
+        for (int j = 0; j < 2; j++)
+        {
+            unsigned t = bt[i][0], t1, t2;
+            if (ct[j][0] != t || !is_nand(n, t, &t1, &t2) || t1 == t2)
+                continue;
+            if ((bt[i][1] == t1 && ct[j][1] == t2) ||
+                (bt[i][1] == t2 && ct[j][1] == t1))
+            {
+                *x = bt[i][1];
+                *y = ct[j][1];
+                return true;
+            }
+        }
+    return false;
+}
+
+/* What rA = ~(rB & rC) is, given the NANDs that wrote rB and rC */
+static Ir_Insn logic(const Nands_T *n, unsigned a, unsigned b, unsigned c)
+{
+    unsigned x, y;
+
+    if (b == c)
+    {
+        /* NOT of a NAND */
+        if (!is_nand(n, b, &x, &y))
+            return op_unary(IR_NOT, a, b, 0);
+        if (x == y)
+            return op_unary(IR_MOV, a, x, 0);
+
+        unsigned p;
+        if (is_not(n, x, &p))
+            return op_binary(IR_ANDN, a, y, p);
+        if (is_not(n, y, &p))
+            return op_binary(IR_ANDN, a, x, p);
+        return op_binary(IR_AND, a, x, y);
+    }
+
+    if (is_xor(n, b, c, &x, &y))
+        return op_binary(IR_XOR, a, x, y);
+
+    bool nb = is_not(n, b, &x), nc = is_not(n, c, &y);
+    if (nb && nc)
+        return op_binary(IR_OR, a, x, y);
+    if (nb)
+        return op_binary(IR_ORN, a, x, c);
+    if (nc)
+        return op_binary(IR_ORN, a, y, b);
+    return op_binary(IR_NAND, a, b, c);
+}
+
+void opt_logic(Ir_Block *block)
+{
+    Nands_T n;
+    memset(&n, 0, sizeof(n));
+
+    for (uint32_t i = 0; i < block->n; i++)
+    {
+        Ir_Insn *in = &block->insns[i];
+        bool nand = in->op == IR_NAND;
+        unsigned a = in->a, b = in->b, c = in->c;
+
+        /* The NAND is remembered as written, whatever it becomes */
+        if (nand)
+        {
+            *in = logic(&n, a, b, c);
+            n.b[a] = b;
+            n.c[a] = c;
+            n.vb[a] = n.version[b];
+            n.vc[a] = n.version[c];
+        }
+
+        for (unsigned r = 0; r < 8; r++)
+            if (in->def & BIT(r))
+            {
+                n.version[r]++;
+                n.nand[r] = nand;
+            }
+    }
+}
+
+/* Whether dropping the instruction can only change the registers it writes.
+ * Load and Divide stay, since they fail on a bad segment or a zero divisor. */
+static bool pure(uint8_t op)
+{
+    switch (op)
+    {
+    case IR_CMOV:
+    case IR_ADD:
+    case IR_MUL:
+    case IR_NAND:
+    case IR_CONST:
+        return true;
+    default:
+        return op >= IR_MOV && op <= IR_ORN;
+    }
+}
+
+void opt_dead(Ir_Block *block)
+{
+    /* Every register is live where the block ends, whether it leaves the
+     * compiled code, jumps or runs on into the next block */
+    uint8_t live = 0xFF;
+
+    for (uint32_t i = block->n; i-- > 0;)
+    {
+        Ir_Insn *in = &block->insns[i];
+        bool self = (in->op == IR_CMOV || in->op == IR_MOV) && in->a == in->b;
+
+        if (self || (pure(in->op) && (in->def & live) == 0))
+            *in = op_nop();
+        else
+            live = (live & ~in->def) | in->use;
+    }
+}
+
+/* A word of memory that a register holds, by the registers that named its
+ * segment and offset, and the versions of all three at the time */
+typedef struct
+{
+    uint8_t seg, off, reg;
+    uint32_t vseg, voff, vreg;
+} Word_T;
+
+#define MAX_WORDS 8 /* Words remembered at once, the latest kept */
+
+void opt_memory(Ir_Block *block)
+{
+    Word_T words[MAX_WORDS];
+    unsigned count = 0;
+    uint32_t version[8] = {0};
+
+    for (uint32_t i = 0; i < block->n; i++)
+    {
+        Ir_Insn *in = &block->insns[i];
+        bool load = in->op == IR_LOAD, store = in->op == IR_STORE;
+        if (!load && !store)
+        {
+            for (unsigned r = 0; r < 8; r++)
+                if (in->def & BIT(r))
+                    version[r]++;
+            continue;
+        }
+
+        unsigned seg = load ? in->b : in->a, off = load ? in->c : in->b;
+        Word_T word = {seg, off, load ? in->a : in->c, version[seg],
+                       version[off], 0};
+
+        /* A Load of a word a register still holds becomes a move. The Store
+         * or Load that put it there used the same address first, so would
+         * have failed first. */
+        for (unsigned w = 0; load && w < count; w++)
+        {
+            Word_T *x = &words[w];
+            if (x->seg == seg && x->off == off && x->vseg == word.vseg &&
+                x->voff == word.voff && version[x->reg] == x->vreg)
+            {
+                *in = op_unary(IR_MOV, in->a, x->reg, 0);
+                break;
+            }
+        }
+
+        if (load)
+            version[word.reg]++;
+
+        /* Any Store may write a word another pair of registers names */
+        if (store)
+            count = 0;
+        else if (count == MAX_WORDS)
+        {
+            memmove(words, words + 1, (MAX_WORDS - 1) * sizeof(Word_T));
+            count--;
+        }
+
+        word.vreg = version[word.reg];
+        words[count++] = word;
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef OPT_H
+#define OPT_H
+
+/* Passes over IR blocks (see ir.h), run in order before a block is lowered.
+ * Each rewrites the block in place and leaves every register holding what
+ * the UM code would have left in it at the block's exit. */
+
+#include "ir.h"
+
+/* Constant propagation and folding. Follows the values Load Value puts in
+ * registers through the block: an instruction whose operands are all known
+ * becomes a Load Value of its result, and one with a known operand becomes a
+ * move, a shift, or arithmetic with a constant, which the backend can lower
+ * to lea, shl, imul with an immediate or a multiply by a reciprocal. */
+void opt_constants(Ir_Block *block);
+
+/* NAND idioms. UM code builds NOT, AND, OR and XOR out of two to four NANDs;
+ * the NAND that finishes one becomes the native operation on the registers
+ * the chain started from, or ANDN or ORN when one of them was negated. The
+ * NANDs before it are left for a later pass to drop if nothing reads them. */
+void opt_logic(Ir_Block *block);
+
+/* Loads of words a register still holds, because a Store in the block put
+ * it there or a Load read it, through the same registers unchanged since. The
+ * Load becomes a move. A Store may write any word, so it forgets the rest. */
+void opt_memory(Ir_Block *block);
+
+/* Dead writes. Works back from the end of the block, where every register is
+ * live, and drops instructions that only write registers written again
+ * before they are read, along with moves of a register to itself. */
+void opt_dead(Ir_Block *block);
+
+#endif
@@ -0,0 +1,339 @@
+/**
+ * @file replay.c
+ * @brief
+ * Allocation replay benchmark. Drives vs_calloc and vs_free with a trace
+ * recorded by ./jit -t, and reports throughput, per call latency and how the
+ * Virt32 heap grew, without running the UM program itself.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "virt.h"
+#include "trace.h"
+
+#define RUNS 3
+#define GROWTH_SAMPLES 10
+
+/* Replay ops are one word each. A Map holds its size in bytes, which is a
+ * multiple of 4; an Unmap holds OP_UNMAP_TAG and the index of the Map whose
+ * segment it frees. */
+#define OP_UNMAP_TAG 1
+#define EMPTY 0xFFFFFFFF
+#define TOMB 0xFFFFFFFE
+
+typedef struct
+{
+    uint32_t *ops;
+    uint32_t len;
+    uint32_t maps;
+    uint32_t unmaps;
+    uint32_t skipped; /* Unmaps of segments the trace never mapped */
+} Trace_T;
+
+/* What the timed pass measures */
+typedef struct
+{
+    uint32_t *map_ns;
+    uint32_t *unmap_ns;
+    uint32_t growth[GROWTH_SAMPLES + 1]; /* Heap bytes through the trace */
+    uint32_t peak;
+    double fragmentation;
+} Pass_T;
+
+/* Recorded ID -> index of the Map that returned it, for the live segments */
+typedef struct
+{
+    uint32_t *keys;
+    uint32_t *vals;
+    uint32_t mask;
+    uint32_t live;
+    uint32_t used; /* Live entries and tombstones */
+} Table_T;
+
+static inline uint32_t slot_of(Table_T *t, uint32_t key)
+{
+    return (key * 2654435761u) & t->mask;
+}
+
+static void table_init(Table_T *t, uint32_t slots)
+{
+    t->keys = malloc(slots * sizeof(uint32_t));
+    t->vals = malloc(slots * sizeof(uint32_t));
+    assert(t->keys != NULL && t->vals != NULL);
+    memset(t->keys, 0xFF, slots * sizeof(uint32_t));
+    t->mask = slots - 1;
+    t->live = 0;
+    t->used = 0;
+}
+
+static void table_put(Table_T *t, uint32_t key, uint32_t val);
+
+/* Rehash once live entries and tombstones fill half the table */
+static void table_rehash(Table_T *t)
+{
+    uint32_t slots = 1 << 16;
+    while (slots < 4 * (uint64_t)t->live)
+        slots *= 2;
+
+    Table_T old = *t;
+    table_init(t, slots);
+    for (uint32_t i = 0; i <= old.mask; i++)
+        if (old.keys[i] != EMPTY && old.keys[i] != TOMB)
+            table_put(t, old.keys[i], old.vals[i]);
+
+    free(old.keys);
+    free(old.vals);
+}
+
+static void table_put(Table_T *t, uint32_t key, uint32_t val)
+{
+    if (2 * (uint64_t)(t->used + 1) > (uint64_t)t->mask + 1)
+        table_rehash(t);
+
+    /* A live segment is never mapped twice, but a key already present would
+     * simply be replaced */
+    uint32_t i = slot_of(t, key);
+    while (t->keys[i] != EMPTY && t->keys[i] != TOMB && t->keys[i] != key)
+        i = (i + 1) & t->mask;
+    if (t->keys[i] == EMPTY)
+        t->used++;
+    if (t->keys[i] != key)
+        t->live++;
+    t->keys[i] = key;
+    t->vals[i] = val;
+}
+
+static bool table_take(Table_T *t, uint32_t key, uint32_t *val)
+{
+    for (uint32_t i = slot_of(t, key); t->keys[i] != EMPTY;
+         i = (i + 1) & t->mask)
+    {
+        if (t->keys[i] == key)
+        {
+            *val = t->vals[i];
+            t->keys[i] = TOMB;
+            t->live--;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void push_op(Trace_T *t, uint32_t *cap, uint32_t op)
+{
+    if (t->len == *cap)
+    {
+        *cap *= 2;
+        t->ops = realloc(t->ops, *cap * sizeof(uint32_t));
+        assert(t->ops != NULL);
+    }
+
+    t->ops[t->len++] = op;
+}
+
+static Trace_T load_trace(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "File %s could not be opened.\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    char magic[TRACE_MAGIC_LEN];
+    if (fread(magic, 1, TRACE_MAGIC_LEN, fp) != TRACE_MAGIC_LEN ||
+        memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0)
+    {
+        fprintf(stderr, "File %s is not an allocation trace.\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    Trace_T t = {NULL, 0, 0, 0, 0};
+    uint32_t cap = 1 << 16;
+    t.ops = malloc(cap * sizeof(uint32_t));
+    assert(t.ops != NULL);
+
+    Table_T live;
+    table_init(&live, 1 << 16);
+
+    Trace_Record r = {0, 0, 0};
+    while (trace_read(fp, &r))
+    {
+        if (r.size != TRACE_UNMAP)
+        {
+            table_put(&live, r.id, t.maps++);
+            push_op(&t, &cap, r.size);
+            continue;
+        }
+
+        uint32_t map_index;
+        if (!table_take(&live, r.id, &map_index))
+        {
+            t.skipped++;
+            continue;
+        }
+
+        t.unmaps++;
+        push_op(&t, &cap, (map_index << 1) | OP_UNMAP_TAG);
+    }
+
+    free(live.keys);
+    free(live.vals);
+    fclose(fp);
+    return t;
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint32_t heap_bytes(Mem_T *mem)
+{
+    return mem->start_unused - mem->begin_unused;
+}
+
+/* One pass over the trace on a fresh allocator. Without a Pass_T the calls
+ * run back to back; with one, every call is timed on its own and the heap is
+ * watched as it grows. Returns the time for the whole pass. */
+static uint64_t replay(Trace_T *t, uint32_t *segs, Pass_T *pass)
+{
+    Mem_T *mem = init_memory_system(KERN_SIZE);
+
+    uint32_t maps = 0;
+    uint64_t start = now_ns();
+
+    if (pass == NULL)
+    {
+        for (uint32_t i = 0; i < t->len; i++)
+        {
+            uint32_t op = t->ops[i];
+            if (op & OP_UNMAP_TAG)
+                vs_free(mem, segs[op >> 1]);
+            else
+                segs[maps++] = vs_calloc(mem, op);
+        }
+    }
+
+    else
+    {
+        uint32_t unmaps = 0;
+        uint32_t sample = 0;
+        memset(pass->growth, 0, sizeof(pass->growth));
+        pass->peak = 0;
+
+        for (uint32_t i = 0; i < t->len; i++)
+        {
+            uint32_t op = t->ops[i];
+            uint64_t before = now_ns();
+            if (op & OP_UNMAP_TAG)
+            {
+                vs_free(mem, segs[op >> 1]);
+                pass->unmap_ns[unmaps++] = now_ns() - before;
+            }
+            else
+            {
+                segs[maps] = vs_calloc(mem, op);
+                pass->map_ns[maps++] = now_ns() - before;
+            }
+
+            if (heap_bytes(mem) > pass->peak)
+                pass->peak = heap_bytes(mem);
+            if (i == (uint64_t)t->len * sample / GROWTH_SAMPLES)
+                pass->growth[sample++] = heap_bytes(mem);
+        }
+
+        pass->growth[GROWTH_SAMPLES] = heap_bytes(mem);
+        pass->fragmentation = vs_fragmentation(mem);
+    }
+
+    uint64_t elapsed = now_ns() - start;
+    terminate_memory_system(mem);
+    return elapsed;
+}
+
+static int by_value(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_latency(const char *name, uint32_t *ns, uint32_t n)
+{
+    if (n == 0)
+        return;
+
+    qsort(ns, n, sizeof(uint32_t), by_value);
+    printf("  %-6s latency   p50 %u  p90 %u  p99 %u  p99.9 %u  max %u ns\n",
+           name, ns[(uint64_t)n * 50 / 100], ns[(uint64_t)n * 90 / 100],
+           ns[(uint64_t)n * 99 / 100], ns[(uint64_t)n * 999 / 1000],
+           ns[n - 1]);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: ./replay [trace]\n");
+        return EXIT_FAILURE;
+    }
+
+    Trace_T t = load_trace(argv[1]);
+    printf("%s: %u maps, %u unmaps", argv[1], t.maps, t.unmaps);
+    if (t.skipped > 0)
+        printf(" (%u unmaps of unknown segments skipped)", t.skipped);
+    printf("\n");
+
+    uint32_t *segs = malloc(((size_t)t.maps + 1) * sizeof(uint32_t));
+    assert(segs != NULL);
+
+    /* Throughput: best of RUNS untimed passes */
+    uint64_t best = UINT64_MAX;
+    for (int run = 0; run < RUNS; run++)
+    {
+        uint64_t elapsed = replay(&t, segs, NULL);
+        if (elapsed < best)
+            best = elapsed;
+    }
+    printf("  throughput       %.1f M calls/s (best of %d, %.3f s)\n",
+           best ? t.len * 1e3 / best : 0.0, RUNS, best / 1e9);
+
+    /* Latency and heap growth, from one pass timing every call */
+    Pass_T pass;
+    pass.map_ns = malloc(((size_t)t.maps + 1) * sizeof(uint32_t));
+    pass.unmap_ns = malloc(((size_t)t.unmaps + 1) * sizeof(uint32_t));
+    assert(pass.map_ns != NULL && pass.unmap_ns != NULL);
+
+    uint64_t overhead = UINT64_MAX;
+    for (int i = 0; i < 1000; i++)
+    {
+        uint64_t before = now_ns();
+        uint64_t after = now_ns();
+        if (after - before < overhead)
+            overhead = after - before;
+    }
+
+    replay(&t, segs, &pass);
+    print_latency("map", pass.map_ns, t.maps);
+    print_latency("unmap", pass.unmap_ns, t.unmaps);
+    printf("  (latencies include about %lu ns of clock overhead)\n", overhead);
+
+    printf("  heap growth     ");
+    for (int i = 0; i <= GROWTH_SAMPLES; i++)
+        printf(" %u", pass.growth[i]);
+    printf("\n  peak heap        %u\n", pass.peak);
+    printf("  fragmentation    %.3f\n", pass.fragmentation);
+
+    free(pass.map_ns);
+    free(pass.unmap_ns);
+    free(segs);
+    free(t.ops);
+    return 0;
+}
@@ -0,0 +1,273 @@
+/**
+ * @file sched.c
+ * @brief
+ * M:N VM scheduler for libumjit. VMs are time-sliced by fuel, which the
+ * generated code spends at every jump, so preempting one costs nothing until
+ * its budget is gone. Each worker thread round-robins the VMs on its own
+ * queue and steals from the back of another's when its queue is empty, and
+ * sleeps when there is nothing on any queue.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "umjit.h"
+
+#define INIT_TASKS 16
+
+typedef struct
+{
+    Umjit_T *vm;
+    uint64_t left; /* Jumps until the VM is killed, or 0 for no limit */
+} Task_T;
+
+/* A ring of tasks */
+typedef struct
+{
+    Task_T *tasks;
+    unsigned head;
+    unsigned len;
+    unsigned cap;
+    pthread_mutex_t lock;
+} Queue_T;
+
+struct Umjit_Sched_T
+{
+    Queue_T *queues;   /* One per worker */
+    unsigned threads;
+    uint64_t slice;
+    unsigned next;     /* Queue for the next VM added */
+    atomic_uint live;  /* VMs neither halted nor killed */
+    atomic_uint queued; /* Tasks on the queues */
+    atomic_uint idle;  /* Workers asleep, or about to be */
+    pthread_mutex_t idle_lock;
+    pthread_cond_t work; /* A task was queued, or no VMs are live */
+};
+
+typedef struct
+{
+    Umjit_Sched_T *sched;
+    unsigned id;
+} Worker_T;
+
+static void push_back(Umjit_Sched_T *s, unsigned id, Task_T t)
+{
+    Queue_T *q = &s->queues[id];
+    pthread_mutex_lock(&q->lock);
+    if (q->len == q->cap)
+    {
+        Task_T *tasks = malloc(2 * q->cap * sizeof(Task_T));
+        assert(tasks != NULL);
+        for (unsigned i = 0; i < q->len; i++)
+            tasks[i] = q->tasks[(q->head + i) % q->cap];
+
+        free(q->tasks);
+        q->tasks = tasks;
+        q->head = 0;
+        q->cap *= 2;
+    }
+
+    q->tasks[(q->head + q->len++) % q->cap] = t;
+    unsigned before = atomic_fetch_add(&s->queued, 1);
+    pthread_mutex_unlock(&q->lock);
+
+    /* The worker requeuing a VM takes the next task itself, so only wake a
+     * sleeper for a second. Counting queued before idle pairs with the
+     * sleeper counting itself before it looks at queued. */
+    if (before > 0 && atomic_load(&s->idle) > 0)
+    {
+        pthread_mutex_lock(&s->idle_lock);
+        pthread_cond_signal(&s->work);
+        pthread_mutex_unlock(&s->idle_lock);
+    }
+}
+
+static bool pop_front(Umjit_Sched_T *s, unsigned id, Task_T *t)
+{
+    Queue_T *q = &s->queues[id];
+    pthread_mutex_lock(&q->lock);
+    bool got = q->len > 0;
+    if (got)
+    {
+        *t = q->tasks[q->head];
+        q->head = (q->head + 1) % q->cap;
+        q->len--;
+        atomic_fetch_sub(&s->queued, 1);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+    return got;
+}
+
+/* Thieves take the task its owner would run last */
+static bool pop_back(Umjit_Sched_T *s, unsigned id, Task_T *t)
+{
+    Queue_T *q = &s->queues[id];
+    pthread_mutex_lock(&q->lock);
+    bool got = q->len > 0;
+    if (got)
+    {
+        *t = q->tasks[(q->head + --q->len) % q->cap];
+        atomic_fetch_sub(&s->queued, 1);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+    return got;
+}
+
+Umjit_Sched_T *umjit_sched_new(unsigned threads, uint64_t slice)
+{
+    assert(threads > 0 && slice > 0);
+
+    Umjit_Sched_T *sched = malloc(sizeof(Umjit_Sched_T));
+    assert(sched != NULL);
+    sched->queues = malloc(threads * sizeof(Queue_T));
+    assert(sched->queues != NULL);
+
+    for (unsigned i = 0; i < threads; i++)
+    {
+        Queue_T *q = &sched->queues[i];
+        q->tasks = malloc(INIT_TASKS * sizeof(Task_T));
+        assert(q->tasks != NULL);
+        q->head = 0;
+        q->len = 0;
+        q->cap = INIT_TASKS;
+        pthread_mutex_init(&q->lock, NULL);
+    }
+
+    sched->threads = threads;
+    sched->slice = slice;
+    sched->next = 0;
+    atomic_init(&sched->live, 0);
+    atomic_init(&sched->queued, 0);
+    atomic_init(&sched->idle, 0);
+    pthread_mutex_init(&sched->idle_lock, NULL);
+    pthread_cond_init(&sched->work, NULL);
+    return sched;
+}
+
+void umjit_sched_free(Umjit_Sched_T **sched)
+{
+    assert(sched != NULL && *sched != NULL);
+    Umjit_Sched_T *s = *sched;
+
+    for (unsigned i = 0; i < s->threads; i++)
+    {
+        free(s->queues[i].tasks);
+        pthread_mutex_destroy(&s->queues[i].lock);
+    }
+
+    pthread_mutex_destroy(&s->idle_lock);
+    pthread_cond_destroy(&s->work);
+    free(s->queues);
+    free(s);
+    *sched = NULL;
+}
+
+void umjit_sched_add(Umjit_Sched_T *sched, Umjit_T *vm, uint64_t limit)
+{
+    /* Spread VMs over the queues up front; stealing evens out the rest */
+    push_back(sched, sched->next, (Task_T){vm, limit});
+    sched->next = (sched->next + 1) % sched->threads;
+    atomic_fetch_add(&sched->live, 1);
+}
+
+static bool take(Umjit_Sched_T *s, unsigned id, Task_T *t)
+{
+    if (pop_front(s, id, t))
+        return true;
+
+    for (unsigned i = 1; i < s->threads; i++)
+        if (pop_back(s, (id + i) % s->threads, t))
+            return true;
+
+    return false;
+}
+
+/* Sleep until a task is queued or no VMs are live */
+static void wait_for_work(Umjit_Sched_T *s)
+{
+    pthread_mutex_lock(&s->idle_lock);
+    atomic_fetch_add(&s->idle, 1);
+    while (atomic_load(&s->queued) == 0 && atomic_load(&s->live) > 0)
+        pthread_cond_wait(&s->work, &s->idle_lock);
+    atomic_fetch_sub(&s->idle, 1);
+    pthread_mutex_unlock(&s->idle_lock);
+}
+
+static void retire(Umjit_Sched_T *s)
+{
+    if (atomic_fetch_sub(&s->live, 1) == 1)
+    {
+        pthread_mutex_lock(&s->idle_lock);
+        pthread_cond_broadcast(&s->work);
+        pthread_mutex_unlock(&s->idle_lock);
+    }
+}
+
+static void *worker(void *cl)
+{
+    Worker_T *w = cl;
+    Umjit_Sched_T *s = w->sched;
+
+    Task_T t;
+    while (atomic_load(&s->live) > 0)
+    {
+        /* A VM being run by another worker is on no queue, so there may be
+         * nothing to take even though VMs are live */
+        if (!take(s, w->id, &t))
+        {
+            wait_for_work(s);
+            continue;
+        }
+
+        uint64_t budget = s->slice;
+        if (t.left != 0 && t.left < budget)
+            budget = t.left;
+
+        /* Halted, waiting on input, or killed by the time it was added */
+        if (umjit_run_budget(t.vm, budget) != UMJIT_OUT_OF_FUEL)
+        {
+            retire(s);
+            continue;
+        }
+
+        if (t.left != 0)
+        {
+            t.left -= budget;
+            if (t.left == 0)
+            {
+                umjit_kill(t.vm);
+                retire(s);
+                continue;
+            }
+        }
+
+        push_back(s, w->id, t);
+    }
+
+    return NULL;
+}
+
+void umjit_sched_run(Umjit_Sched_T *sched)
+{
+    pthread_t *pool = malloc(sched->threads * sizeof(pthread_t));
+    Worker_T *workers = malloc(sched->threads * sizeof(Worker_T));
+    assert(pool != NULL && workers != NULL);
+
+    for (unsigned i = 0; i < sched->threads; i++)
+    {
+        workers[i] = (Worker_T){sched, i};
+        int result = pthread_create(&pool[i], NULL, worker, &workers[i]);
+        assert(result == 0);
+    }
+
+    for (unsigned i = 0; i < sched->threads; i++)
+        pthread_join(pool[i], NULL);
+
+    free(pool);
+    free(workers);
+}
@@ -0,0 +1,373 @@
+/**
+ * @file server.c
+ * @brief
+ * Session server. Listens on a UNIX socket and runs one VM of a shared
+ * compiled program per connection, with the connection as its input and
+ * output. An Input with nothing to read suspends the VM instead of blocking,
+ * so each worker thread multiplexes its sessions over one epoll set and an
+ * idle session costs no thread at all.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "umjit.h"
+
+#define MAX_THREADS 256
+#define MAX_EVENTS 64
+#define SLICE ((uint64_t)1 << 20) /* Jumps a session runs before others */
+#define READ_SIZE 4096
+#define IN_LIMIT (1 << 16)  /* Unread input past which reading pauses */
+#define OUT_LIMIT (1 << 16) /* Unsent output past which the VM pauses */
+
+typedef struct
+{
+    uint8_t *data;
+    size_t pos;
+    size_t len;
+    size_t cap;
+} Bytes_T;
+
+typedef struct Session_T
+{
+    int fd;
+    Umjit_T *vm;
+    Bytes_T in;
+    Bytes_T out;
+    bool eof;          /* The client will send no more */
+    bool done;         /* The program has halted; output is draining */
+    bool ready;        /* On its worker's ready list */
+    uint32_t events;   /* What the epoll set watches for */
+    struct Session_T *next_ready;
+} Session_T;
+
+typedef struct
+{
+    Umjit_Program_T *prog;
+    int listener;
+    int epoll;
+    Session_T *ready_head;
+    Session_T *ready_tail;
+} Worker_T;
+
+static size_t pending(Bytes_T *b)
+{
+    return b->len - b->pos;
+}
+
+static void append(Bytes_T *b, const uint8_t *src, size_t n)
+{
+    /* Consumed bytes are dropped before the buffer grows */
+    if (b->pos > 0)
+    {
+        memmove(b->data, b->data + b->pos, pending(b));
+        b->len -= b->pos;
+        b->pos = 0;
+    }
+
+    if (b->len + n > b->cap)
+    {
+        while (b->len + n > b->cap)
+            b->cap = b->cap ? 2 * b->cap : READ_SIZE;
+        b->data = realloc(b->data, b->cap);
+        assert(b->data != NULL);
+    }
+
+    memcpy(b->data + b->len, src, n);
+    b->len += n;
+}
+
+static int session_get(void *cl)
+{
+    Session_T *s = cl;
+    if (pending(&s->in) > 0)
+        return s->in.data[s->in.pos++];
+    return s->eof ? EOF : UMJIT_WOULD_BLOCK;
+}
+
+static void session_put(uint8_t c, void *cl)
+{
+    Session_T *s = cl;
+    append(&s->out, &c, 1);
+}
+
+/* Worth running: not stalled on input, and the client is keeping up */
+static bool runnable(Session_T *s)
+{
+    if (s->done || pending(&s->out) >= OUT_LIMIT)
+        return false;
+    return umjit_status(s->vm) != UMJIT_WAITING || pending(&s->in) > 0 ||
+           s->eof;
+}
+
+static void make_ready(Worker_T *w, Session_T *s)
+{
+    if (s->ready || !runnable(s))
+        return;
+
+    s->ready = true;
+    s->next_ready = NULL;
+    if (w->ready_tail != NULL)
+        w->ready_tail->next_ready = s;
+    else
+        w->ready_head = s;
+    w->ready_tail = s;
+}
+
+static Session_T *take_ready(Worker_T *w)
+{
+    Session_T *s = w->ready_head;
+    if (s != NULL)
+    {
+        w->ready_head = s->next_ready;
+        if (w->ready_head == NULL)
+            w->ready_tail = NULL;
+        s->ready = false;
+    }
+
+    return s;
+}
+
+static void close_session(Worker_T *w, Session_T *s)
+{
+    epoll_ctl(w->epoll, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    umjit_free(&s->vm);
+    free(s->in.data);
+    free(s->out.data);
+    free(s);
+}
+
+/* Watch for input while there is room for it, and for room to write while
+ * output is waiting */
+static void watch(Worker_T *w, Session_T *s)
+{
+    uint32_t events = 0;
+    if (!s->eof && !s->done && pending(&s->in) < IN_LIMIT)
+        events |= EPOLLIN;
+    if (pending(&s->out) > 0)
+        events |= EPOLLOUT;
+
+    if (events != s->events)
+    {
+        struct epoll_event ev = {.events = events, .data.ptr = s};
+        epoll_ctl(w->epoll, EPOLL_CTL_MOD, s->fd, &ev);
+        s->events = events;
+    }
+}
+
+/* Returns false once the client is gone */
+static bool flush(Session_T *s)
+{
+    while (pending(&s->out) > 0)
+    {
+        ssize_t n = send(s->fd, s->out.data + s->out.pos, pending(&s->out),
+                         MSG_NOSIGNAL);
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        s->out.pos += n;
+    }
+
+    return true;
+}
+
+/* Returns false once the client is gone */
+static bool fill(Session_T *s)
+{
+    uint8_t buf[READ_SIZE];
+    while (pending(&s->in) < IN_LIMIT)
+    {
+        ssize_t n = recv(s->fd, buf, sizeof(buf), 0);
+        if (n > 0)
+            append(&s->in, buf, n);
+        else if (n == 0)
+        {
+            s->eof = true;
+            break;
+        }
+        else if (errno == EINTR)
+            continue;
+        else
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+
+    return true;
+}
+
+static void accept_sessions(Worker_T *w)
+{
+    int fd;
+    while ((fd = accept4(w->listener, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+    {
+        Session_T *s = calloc(1, sizeof(Session_T));
+        assert(s != NULL);
+        s->fd = fd;
+        s->vm = umjit_new();
+        umjit_use(s->vm, w->prog);
+        umjit_set_io(s->vm, (Umjit_IO){session_get, session_put, s});
+
+        s->events = EPOLLIN;
+        struct epoll_event ev = {.events = s->events, .data.ptr = s};
+        epoll_ctl(w->epoll, EPOLL_CTL_ADD, fd, &ev);
+
+        /* The program runs until its first Input straight away */
+        make_ready(w, s);
+    }
+}
+
+/* One slice of one session */
+static void step(Worker_T *w, Session_T *s)
+{
+    int status = umjit_run_budget(s->vm, SLICE);
+    s->done = status == UMJIT_HALTED || status == UMJIT_KILLED;
+
+    /* A finished session stays until the client has taken its output */
+    if (!flush(s) || (s->done && pending(&s->out) == 0))
+    {
+        close_session(w, s);
+        return;
+    }
+
+    watch(w, s);
+    make_ready(w, s);
+}
+
+static void *worker(void *cl)
+{
+    Worker_T *w = cl;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;)
+    {
+        /* Sessions with work left only need a glance at the sockets */
+        int timeout = w->ready_head != NULL ? 0 : -1;
+        int n = epoll_wait(w->epoll, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR)
+            break;
+
+        for (int i = 0; i < n; i++)
+        {
+            Session_T *s = events[i].data.ptr;
+            if (s == NULL)
+            {
+                accept_sessions(w);
+                continue;
+            }
+
+            bool alive = true;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                alive = fill(s);
+            if (alive && (events[i].events & EPOLLOUT))
+                alive = flush(s);
+
+            if (!alive || (s->done && pending(&s->out) == 0))
+            {
+                /* A session on the ready list is closed when it is run */
+                s->eof = true;
+                if (!s->ready)
+                    close_session(w, s);
+                continue;
+            }
+
+            watch(w, s);
+            make_ready(w, s);
+        }
+
+        /* One slice for each session that was ready before this pass, so
+         * none waits behind a busy one for more than a round */
+        Session_T *last = w->ready_tail;
+        Session_T *s;
+        while (last != NULL && (s = take_ready(w)) != NULL)
+        {
+            bool end = s == last;
+            step(w, s);
+            if (end)
+                break;
+        }
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    bool bad_usage = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:")) != -1)
+    {
+        if (opt == 'j')
+            threads = strtol(optarg, NULL, 10);
+        else
+            bad_usage = true;
+    }
+
+    if (bad_usage || threads < 1 || optind != argc - 2)
+    {
+        fprintf(stderr, "Usage: ./server [-j threads] [socket] "
+                        "[executable.um]\n");
+        return EXIT_FAILURE;
+    }
+
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+
+    const char *path = argv[optind + 1];
+    Umjit_Program_T *prog = umjit_compile_file(path);
+    if (prog == NULL)
+    {
+        fprintf(stderr, "File %s could not be opened.\n", path);
+        return EXIT_FAILURE;
+    }
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    const char *sock_path = argv[optind];
+    if (strlen(sock_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path %s is too long.\n", sock_path);
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, sock_path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    unlink(sock_path);
+    if (listener < 0 ||
+        bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listener, SOMAXCONN) != 0)
+    {
+        fprintf(stderr, "Socket %s could not be opened.\n", sock_path);
+        return EXIT_FAILURE;
+    }
+
+    /* Every worker watches the listener; only one wakes per connection */
+    Worker_T workers[MAX_THREADS];
+    pthread_t pool[MAX_THREADS];
+    for (long t = 0; t < threads; t++)
+    {
+        workers[t] = (Worker_T){prog, listener, epoll_create1(0), NULL, NULL};
+        assert(workers[t].epoll >= 0);
+
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLEXCLUSIVE,
+                                 .data.ptr = NULL};
+        epoll_ctl(workers[t].epoll, EPOLL_CTL_ADD, listener, &ev);
+
+        int result = pthread_create(&pool[t], NULL, worker, &workers[t]);
+        assert(result == 0);
+    }
+
+    for (long t = 0; t < threads; t++)
+        pthread_join(pool[t], NULL);
+
+    umjit_program_free(&prog);
+    return 0;
+}
@@ -0,0 +1,204 @@
+#include "stats.h"
+#include "virt.h"
+#include <signal.h>
+
+bool stats_enabled = false;
+
+typedef struct
+{
+    uint64_t maps;
+    uint64_t hits;
+} Class_T;
+
+typedef struct
+{
+    uint64_t maps;
+    uint64_t bytes;
+} Site_T;
+
+static uint64_t maps;
+static uint64_t unmaps;
+static uint64_t bytes_carved;
+static uint64_t bytes_recycled;
+static uint64_t live_bytes;
+static uint64_t peak_live_bytes;
+static uint32_t high_water;
+static Class_T classes[STATS_CLASSES];
+
+/* Map sites, indexed by UM program counter */
+static Site_T *sites;
+static uint32_t sites_len;
+
+static volatile sig_atomic_t report_pending;
+
+static void on_report_signal(int sig)
+{
+    (void)sig;
+    report_pending = 1;
+}
+
+/* Reporting from the handler itself is not async-signal-safe, so it waits
+ * for the next allocator call */
+static inline void check_pending(Mem_T *mem)
+{
+    if (report_pending)
+    {
+        report_pending = 0;
+        stats_report(mem);
+    }
+}
+
+static uint32_t size_class(uint32_t cap)
+{
+    if (cap > MAX_ALLOC)
+        return STATS_CLASSES - 1;
+
+    uint32_t blocks = (cap + BOOK_SIZE) / BLOCK_SIZE;
+    uint32_t k = 0;
+    while (blocks >>= 1)
+        k++;
+    return k;
+}
+
+void stats_init(Mem_T *mem)
+{
+    high_water = mem->start_unused;
+    signal(SIGUSR1, on_report_signal);
+}
+
+void stats_terminate(void)
+{
+    signal(SIGUSR1, SIG_DFL);
+    free(sites);
+    sites = NULL;
+    sites_len = 0;
+}
+
+void stats_map(Mem_T *mem, uint32_t seg, bool recycled)
+{
+    uint32_t *addr = convert_address(mem->usable_mem, seg);
+    uint32_t cap = addr[-2];
+    Class_T *class = &classes[size_class(cap)];
+
+    maps++;
+    class->maps++;
+    if (recycled)
+    {
+        class->hits++;
+        bytes_recycled += cap;
+    }
+    else
+        bytes_carved += cap;
+
+    live_bytes += addr[-1];
+    if (live_bytes > peak_live_bytes)
+        peak_live_bytes = live_bytes;
+    if (mem->start_unused > high_water)
+        high_water = mem->start_unused;
+
+    check_pending(mem);
+}
+
+void stats_unmap(Mem_T *mem, uint32_t seg)
+{
+    uint32_t *addr = convert_address(mem->usable_mem, seg);
+
+    unmaps++;
+    live_bytes -= addr[-1];
+
+    check_pending(mem);
+}
+
+void stats_site(uint32_t pc, uint32_t size)
+{
+    if (pc >= sites_len)
+    {
+        uint32_t len = sites_len ? sites_len : 1024;
+        while (len <= pc)
+            len *= 2;
+
+        Site_T *temp = realloc(sites, len * sizeof(Site_T));
+        assert(temp != NULL);
+        memset(temp + sites_len, 0, (len - sites_len) * sizeof(Site_T));
+        sites = temp;
+        sites_len = len;
+    }
+
+    sites[pc].maps++;
+    sites[pc].bytes += size;
+}
+
+static int by_maps(const void *a, const void *b)
+{
+    const Site_T *x = &sites[*(const uint32_t *)a];
+    const Site_T *y = &sites[*(const uint32_t *)b];
+    if (x->maps != y->maps)
+        return x->maps < y->maps ? 1 : -1;
+    return *(const uint32_t *)a < *(const uint32_t *)b ? -1 : 1;
+}
+
+static void report_sites(void)
+{
+    uint32_t n = 0;
+    for (uint32_t pc = 0; pc < sites_len; pc++)
+        if (sites[pc].maps > 0)
+            n++;
+
+    if (n == 0)
+        return;
+
+    uint32_t *order = malloc(n * sizeof(uint32_t));
+    assert(order != NULL);
+    n = 0;
+    for (uint32_t pc = 0; pc < sites_len; pc++)
+        if (sites[pc].maps > 0)
+            order[n++] = pc;
+
+    qsort(order, n, sizeof(uint32_t), by_maps);
+
+    fprintf(stderr, "  top map sites (of %u):\n", n);
+    fprintf(stderr, "    %10s %12s %14s\n", "pc", "maps", "bytes");
+    for (uint32_t i = 0; i < n && i < STATS_TOP_SITES; i++)
+    {
+        Site_T *s = &sites[order[i]];
+        fprintf(stderr, "    %10u %12lu %14lu\n", order[i], s->maps,
+                s->bytes);
+    }
+
+    free(order);
+}
+
+void stats_report(Mem_T *mem)
+{
+    fprintf(stderr, "Virt32 statistics:\n");
+    fprintf(stderr, "  maps              %lu\n", maps);
+    fprintf(stderr, "  unmaps            %lu\n", unmaps);
+    fprintf(stderr, "  bytes carved      %lu\n", bytes_carved);
+    fprintf(stderr, "  bytes recycled    %lu\n", bytes_recycled);
+    fprintf(stderr, "  live bytes        %lu\n", live_bytes);
+    fprintf(stderr, "  peak live bytes   %lu\n", peak_live_bytes);
+    fprintf(stderr, "  heap high water   %u\n",
+            high_water - mem->begin_unused);
+    fprintf(stderr, "  heap now          %u\n",
+            mem->start_unused - mem->begin_unused);
+    fprintf(stderr, "  fragmentation     %.3f\n", vs_fragmentation(mem));
+
+    fprintf(stderr, "  recycler hits by size class:\n");
+    fprintf(stderr, "    %10s %12s %8s\n", "cap up to", "maps", "hit rate");
+    for (uint32_t k = 0; k < STATS_CLASSES; k++)
+    {
+        Class_T *c = &classes[k];
+        if (c->maps == 0)
+            continue;
+
+        double rate = 100.0 * c->hits / c->maps;
+        if (k == STATS_CLASSES - 1)
+            fprintf(stderr, "    %10s %12lu %7.1f%%\n", "large", c->maps, rate);
+        else
+            fprintf(stderr, "    %10u %12lu %7.1f%%\n",
+                    (((uint32_t)2 << k) - 1) * BLOCK_SIZE - BOOK_SIZE, c->maps,
+                    rate);
+    }
+
+    report_sites();
+}
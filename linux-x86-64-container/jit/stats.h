@@ -0,0 +1,38 @@
+#ifndef STATS_H
+#define STATS_H
+
+/* Virt32 allocator statistics.
+ * Off unless the JIT is started with -s. While on, every Map and Unmap goes
+ * through the C allocator so it can be counted, and Map is also attributed to
+ * the UM program counter it came from. The report goes to stderr when the
+ * program halts, or at the next Map or Unmap after a SIGUSR1. The counters
+ * are process wide, so they describe one VM at a time. */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct Mem_T;
+
+/* Size classes: class k holds the buckets of 2^k to 2^(k+1) - 1 blocks, and
+ * the last class holds every large segment */
+#define STATS_CLASSES 21
+#define STATS_TOP_SITES 10
+
+extern bool stats_enabled;
+
+void stats_init(struct Mem_T *mem);
+
+void stats_terminate(void);
+
+/* Called by the allocator with the segment it just handed out or is about to
+ * take back */
+void stats_map(struct Mem_T *mem, uint32_t seg, bool recycled);
+
+void stats_unmap(struct Mem_T *mem, uint32_t seg);
+
+/* Called by the JIT with the UM program counter of a Map instruction */
+void stats_site(uint32_t pc, uint32_t size);
+
+void stats_report(struct Mem_T *mem);
+
+#endif
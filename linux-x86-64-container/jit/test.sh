@@ -56,4 +56,474 @@ if [ "$output" = "7" ]; then
   echo "Test passed"
 else
   echo "Test failed. Got: $output"
-fi
\ No newline at end of file
+fi
+
+echo "Testing Big Segment"
+output=$(./jit ../umasm/big-segment.um)
+if [ "$output" = "60" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Huge Segment"
+output=$(./jit ../umasm/huge-segment.um 2>&1)
+expected="Error: Segment of 1073741824 words is too large to map"
+if [ "$output" = "$expected" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+# The optimizing tier is only built where LLVM is installed
+modes="-i -T"
+if [ -f umjit-tier.so ]; then
+  modes="$modes -O"
+fi
+
+echo "Testing Wild Load"
+output=$(for mode in "" $modes; do
+  timeout 10 ./jit $mode ../umasm/wild-load.um
+  echo "$?"
+done 2> /dev/null | uniq)
+if [ "$output" = "139" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Past End"
+output=$(for mode in "" $modes; do
+  timeout 10 ./jit $mode ../umasm/past-end.um 2>&1
+done | uniq)
+expected="Error: PC 16777216 is past the end of the 7 word program"
+if [ "$output" = "$expected" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Indirect Addressing"
+output=$(./jit -i ../umasm/midmark.um)
+expected=$(./jit ../umasm/midmark.um)
+if [ "$output" = "$expected" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Indirect Big Segment"
+output=$(./jit -i ../umasm/big-segment.um)
+if [ "$output" = "60" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Compaction"
+output=$(./jit -s ../umasm/compact.um 2>&1 | awk '
+  /^[0-9a-f]+$/ { print }
+  /heap high water/ { high = $4 }
+  /heap now/ { now = $3 }
+  END { print (now < high ? "trimmed" : "not trimmed") }')
+expected=$(printf "002709c0\ntrimmed")
+if [ "$output" = "$expected" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Segment Alignment"
+output=$(./jit ../umasm/aligned.um | uniq -c | awk '{print $1, $2}')
+if [ "$output" = "6 00000000" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Recycled Segments"
+output=$(./jit ../umasm/recycle.um | uniq -c | awk '{print $1, $2}')
+expected=$(./jit -s ../umasm/recycle.um 2> /dev/null | uniq -c | awk '{print $1, $2}')
+if [ "$output" = "8 00000000" ] && [ "$output" = "$expected" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Map Fast Path"
+output=$(./jit ../umasm/midmark.um)
+expected=$(./jit -s ../umasm/midmark.um 2> /dev/null)
+if [ "$output" = "$expected" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Allocator Statistics"
+output=$(./jit -s ../umasm/recycle.um 2>&1 > /dev/null |
+  awk '/^  (maps|unmaps|bytes recycled) / {print $NF}')
+expected=$(printf "16\n8\n4960")
+if [ "$output" = "$expected" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Allocation Trace Replay"
+make -s replay
+trace=$(mktemp)
+./jit -t "$trace" ../umasm/recycle.um > /dev/null
+output=$(./replay "$trace" | awk '
+  NR == 1 { sub(/^.*: /, ""); print }
+  /peak heap/ { print $3 }')
+rm -f "$trace"
+expected=$(printf "16 maps, 8 unmaps\n5120")
+if [ "$output" = "$expected" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Allocator Contexts On Threads"
+make -s batch
+dir=$(mktemp -d)
+for i in 1 2 3 4; do
+  touch "$dir/$i"
+done
+./batch -j 4 ../umasm/compact.um "$dir"/1 "$dir"/2 "$dir"/3 "$dir"/4
+output=$(cat "$dir"/*.out | uniq -c | awk '{print $1, $2}')
+rm -rf "$dir"
+if [ "$output" = "4 002709c0" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Library"
+make -s libumjit.a
+dir=$(mktemp -d)
+cat > "$dir/host.c" << 'HOST'
+#include <stdio.h>
+#include <stdlib.h>
+#include "umjit.h"
+
+/* Runs the program on "abc" one jump at a time, then again after a reset */
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    Umjit_Buffers buf = {(const uint8_t *)"abc\n", 4, 0, NULL, 0, 0};
+    Umjit_T *vm = umjit_new();
+    if (umjit_load_file(vm, argv[1]) != 0)
+        return 1;
+    umjit_set_io(vm, umjit_buffer_io(&buf));
+
+    int first = umjit_run_budget(vm, 1);
+    while (umjit_run_budget(vm, 1) == UMJIT_OUT_OF_FUEL)
+        ;
+    umjit_reset(vm);
+    buf.in_pos = 0;
+    umjit_run(vm);
+
+    fwrite(buf.out, 1, buf.out_len, stdout);
+    printf("%d %d\n", first, umjit_status(vm));
+    free(buf.out);
+    umjit_free(&vm);
+    return 0;
+}
+HOST
+cc -I. -o "$dir/host" "$dir/host.c" libumjit.a 2> /dev/null
+output=$("$dir/host" ../umasm/cat.um)
+rm -rf "$dir"
+expected=$(printf "abc\nabc\n2 1")
+if [ "$output" = "$expected" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Batch"
+make -s batch
+dir=$(mktemp -d)
+printf "1\n" > "$dir/1"
+printf "abc\n" > "$dir/2"
+printf "" > "$dir/3"
+./batch -j 2 ../umasm/cat.um "$dir"/1 "$dir"/2 "$dir"/3
+output=$(cat "$dir"/1.out "$dir"/2.out "$dir"/3.out)
+expected=$(for i in 1 2 3; do ./jit ../umasm/cat.um < "$dir/$i"; done)
+rm -rf "$dir"
+if [ "$output" = "$expected" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Scheduler"
+make -s batch
+dir=$(mktemp -d)
+touch "$dir/1" "$dir/2" "$dir/3"
+./batch -j 2 -q 1000 ../umasm/hot-loop.um "$dir"/1 "$dir"/2
+output=$(cat "$dir"/1.out "$dir"/2.out
+  ./batch -q 1000 -l 1000 ../umasm/hot-loop.um "$dir"/3 2>&1 |
+    sed "s|$dir/||")
+rm -rf "$dir"
+expected=$(printf "1aae2ba5\n1aae2ba5\nInput 3 was stopped after 1000 jumps.")
+if [ "$output" = "$expected" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Session Server"
+make -s server
+# The client stays for the fork server test
+sockets=$(mktemp -d)
+cat > "$sockets/client.c" << 'CLIENT'
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Sends stdin to the UNIX socket argv[1], then copies what comes back to
+ * stdout until the server closes the connection */
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        return 1;
+
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(0, buf, sizeof(buf))) > 0)
+        if (write(fd, buf, n) != n)
+            return 1;
+    shutdown(fd, SHUT_WR);
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        fwrite(buf, 1, n, stdout);
+    return 0;
+}
+CLIENT
+cc -o "$sockets/client" "$sockets/client.c"
+./server -j 1 "$sockets/sock" ../umasm/cat.um &
+server=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+  [ -S "$sockets/sock" ] || sleep 0.1
+done
+# A session waiting on input must not hold up the others on its thread
+mkfifo "$sockets/idle"
+"$sockets/client" "$sockets/sock" < "$sockets/idle" > "$sockets/0" &
+idle=$!
+exec 3> "$sockets/idle"
+echo abc | timeout 10 "$sockets/client" "$sockets/sock" > "$sockets/1"
+echo hello | timeout 10 "$sockets/client" "$sockets/sock" > "$sockets/2"
+echo late >&3
+exec 3>&-
+wait $idle
+output=$(cat "$sockets/1" "$sockets/2" "$sockets/0")
+kill $server
+wait $server 2> /dev/null
+expected=$(printf "abc\nhello\nlate")
+if [ "$output" = "$expected" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Fork Server"
+./jit -f "$sockets/fork" ../umasm/midmark.um &
+server=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+  [ -S "$sockets/fork" ] || sleep 0.1
+done
+output=$(for i in 1 2; do
+  timeout 10 "$sockets/client" "$sockets/fork" < /dev/null
+done)
+kill $server
+wait $server 2> /dev/null
+rm -rf "$sockets"
+expected=$(for i in 1 2; do ./jit ../umasm/midmark.um; done)
+if [ "$output" = "$expected" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Snapshot And Restore"
+snapshot=$(mktemp)
+output=$(./jit -c "$snapshot" ../umasm/snapshot.um; echo z | ./jit -r "$snapshot")
+rm -f "$snapshot"
+expected=$(echo z | ./jit ../umasm/snapshot.um)
+if [ "$output" = "$expected" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Code Cache"
+cache=$(mktemp -d)
+output=$(./jit -k "$cache" ../umasm/midmark.um
+  ls "$cache" | wc -l
+  ./jit -k "$cache" ../umasm/midmark.um
+  truncate -s 100 "$cache"/*
+  ./jit -k "$cache" ../umasm/midmark.um)
+rm -rf "$cache"
+expected=$(./jit ../umasm/midmark.um; echo 1
+  ./jit ../umasm/midmark.um; ./jit ../umasm/midmark.um)
+if [ "$output" = "$expected" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Shared Code Cache"
+name=/umjit-test-$$
+dir=$(mktemp -d)
+for i in 1 2 3 4; do
+  ./jit -K $name ../umasm/midmark.um > "$dir/$i" &
+done
+wait
+./jit -K $name ../umasm/midmark.um > "$dir/5"
+output=$(cat "$dir"/*)
+rm -rf "$dir" /dev/shm$name
+expected=$(for i in 1 2 3 4 5; do ./jit ../umasm/midmark.um; done)
+if [ "$output" = "$expected" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Ahead-of-Time Compilation"
+dir=$(mktemp -d)
+./jit -a "$dir/midmark" ../umasm/midmark.um
+./jit -a "$dir/cat" ../umasm/cat.um
+output=$("$dir/midmark"; echo abc | "$dir/cat")
+rm -rf "$dir"
+expected=$(./jit ../umasm/midmark.um; echo abc | ./jit ../umasm/cat.um)
+if [ "$output" = "$expected" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Static Recompilation"
+make -s um2c libumjit.a
+dir=$(mktemp -d)
+for program in hot-loop midmark cat wild-load div-zero past-end; do
+  ./um2c ../umasm/$program.um "$dir/$program.c"
+  cc -O2 -I. -o "$dir/$program" "$dir/$program.c" libumjit.a 2> /dev/null
+done
+output=$("$dir/hot-loop"; "$dir/midmark"; echo abc | "$dir/cat"
+  for program in wild-load div-zero; do
+    timeout 10 "$dir/$program"
+    echo "$?"
+  done 2> /dev/null
+  "$dir/past-end" 2>&1)
+rm -rf "$dir"
+expected=$(./jit ../umasm/hot-loop.um; ./jit ../umasm/midmark.um
+  echo abc | ./jit ../umasm/cat.um
+  for program in wild-load div-zero; do
+    timeout 10 ./jit ../umasm/$program.um
+    echo "$?"
+  done 2> /dev/null
+  ./jit ../umasm/past-end.um 2>&1)
+if [ "$output" = "$expected" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Divide By Zero"
+output=$(for mode in "" $modes; do
+  timeout 10 ./jit $mode ../umasm/div-zero.um
+  echo "$?"
+done 2> /dev/null | uniq)
+if [ "$output" = "136" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Optimizing Tier"
+if [ -f umjit-tier.so ]; then
+  output=$(./jit -O ../umasm/hot-loop.um; ./jit -O ../umasm/midmark.um)
+  expected=$(./jit ../umasm/hot-loop.um; ./jit ../umasm/midmark.um)
+  if [ "$output" = "$expected" ]; then
+    echo "Test passed"
+  else
+    echo "Test failed. Got: $output"
+  fi
+else
+  echo "Test skipped: umjit-tier.so was not built"
+fi
+
+echo "Testing Tracing Tier"
+output=$(./jit -T ../umasm/hot-loop.um; ./jit -T ../umasm/midmark.um)
+expected=$(./jit ../umasm/hot-loop.um; ./jit ../umasm/midmark.um)
+if [ "$output" = "$expected" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Guard Exits"
+output=$(for mode in "" $modes; do
+  ./jit $mode ../umasm/traced.um
+done | uniq)
+if [ "$output" = "3c74f99f" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Blocks"
+output=$(for mode in "" $modes; do
+  ./jit $mode ../umasm/blocks.um
+done | uniq)
+if [ "$output" = "00000130" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Constant Folding"
+output=$(for mode in "" $modes; do
+  ./jit $mode ../umasm/constants.um
+done | uniq)
+if [ "$output" = "bd28584c" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing NAND Idioms"
+output=$(for mode in "" $modes; do
+  ./jit $mode ../umasm/nand-idioms.um
+done | uniq)
+if [ "$output" = "d7401014" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Store To Load Forwarding"
+output=$(for mode in "" $modes; do
+  ./jit $mode ../umasm/forwarding.um
+done | uniq)
+if [ "$output" = "496d661f" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
+
+echo "Testing Dead Writes"
+output=$(for mode in "" $modes; do
+  ./jit $mode ../umasm/dead-writes.um
+done | uniq)
+if [ "$output" = "b47a9c8e" ]; then
+  echo "Test passed"
+else
+  echo "Test failed. Got: $output"
+fi
@@ -0,0 +1,112 @@
+#include "tier.h"
+#include "tracer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <unistd.h>
+
+bool tier_enabled = false;
+bool tier_tracing = false;
+
+/* The plugin's entry points */
+static void *(*compile)(const uint32_t *code, uint32_t words, uint32_t pc);
+
+Tier_T *tier_new(const uint32_t *code, uint32_t words, bool copy)
+{
+    Tier_T *t = malloc(sizeof(Tier_T));
+    assert(t != NULL);
+    t->entry = calloc((size_t)words + 1, sizeof(void *));
+    t->heat = malloc(((size_t)words + 1) * sizeof(uint32_t));
+    assert(t->entry != NULL && t->heat != NULL);
+    for (uint32_t i = 0; i < words; i++)
+        t->heat[i] = tier_tracing ? TRACER_HOT : TIER_HOT;
+    t->words = words;
+
+    /* Loaded code is compiled from the zero segment, which the program may
+     * go on to write to */
+    t->owns_code = copy;
+    if (copy)
+    {
+        uint32_t *own = malloc((size_t)words * sizeof(uint32_t) + 1);
+        assert(own != NULL);
+        memcpy(own, code, (size_t)words * sizeof(uint32_t));
+        t->code = own;
+    }
+    else
+        t->code = code;
+
+    return t;
+}
+
+void tier_free(Tier_T *t)
+{
+    /* Optimized code stays with ORC, which has no cheap way to drop it, but
+     * compiled paths go */
+    for (uint32_t i = 0; tier_tracing && i < t->words; i++)
+        if (t->entry[i] != NULL)
+            tracer_free(t->entry[i]);
+    if (t->owns_code)
+        free((uint32_t *)t->code);
+    free(t->entry);
+    free(t->heat);
+    free(t);
+}
+
+/* The plugin lives next to the executable */
+bool tier_open(void)
+{
+    if (tier_enabled)
+        return true;
+
+    char path[4096];
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len < 0)
+        return false;
+    path[len] = '\0';
+    char *slash = strrchr(path, '/');
+    if (slash == NULL ||
+        (size_t)(slash + 1 - path) + sizeof(TIER_PLUGIN) > sizeof(path))
+        return false;
+    strcpy(slash + 1, TIER_PLUGIN);
+
+    void *plugin = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (plugin == NULL)
+        return false;
+
+    bool (*start)(void);
+    *(void **)&start = dlsym(plugin, "tier_llvm_open");
+    *(void **)&compile = dlsym(plugin, "tier_llvm_compile");
+    tier_enabled = start != NULL && compile != NULL && start();
+    return tier_enabled;
+}
+
+void tier_open_tracer(void)
+{
+    tier_enabled = true;
+    tier_tracing = true;
+}
+
+/* Worth compiling: it starts with something the tier runs itself */
+static bool worth_it(Tier_T *t, uint32_t pc)
+{
+    uint32_t op = t->code[pc] >> 28;
+    return op <= 6 || op == 12 || op == 13;
+}
+
+void tier_compile(Machine_T *m, uint32_t pc)
+{
+    Tier_T *t = m->tier;
+    void *code = NULL;
+    if (tier_tracing)
+        code = tracer_compile(t, m, pc);
+    else if (worth_it(t, pc))
+        code = compile(t->code, t->words, pc);
+
+    /* Its heat is 0 now, which leads the dispatcher to the code. A target
+     * that cannot be compiled is never hot again. */
+    t->entry[pc] = code;
+    if (code == NULL)
+        t->heat[pc] = UINT32_MAX;
+}
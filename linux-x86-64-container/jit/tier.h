@@ -0,0 +1,64 @@
+#ifndef TIER_H
+#define TIER_H
+
+/* Optimizing tier.
+ * Built when LLVM is installed, as the plugin umjit-tier.so beside the JIT,
+ * and turned on with ./jit -O, which loads it.
+ * Every jump through the dispatcher counts against its target; once a target
+ * has been jumped to TIER_HOT times, the region of basic blocks reachable
+ * from it through jumps to constant targets is lowered to LLVM IR and, if
+ * any of those jumps stay inside it, put through the standard -O2 pipeline
+ * and compiled by ORC. Later jumps to that
+ * target run the optimized code instead of the baseline code, which stays as
+ * it was for everything else. Optimized code leaves by returning the next PC
+ * to the dispatcher: at any instruction that calls out (Map, Unmap, Input,
+ * Output, Halt), a Load Program of another segment, a jump out of the region
+ * or a jump once the fuel is nearly gone. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "utility.h"
+
+#define TIER_PLUGIN "umjit-tier.so"
+#define TIER_HOT 100000
+#define TIER_BLOCKS 16 /* Basic blocks in a region at most */
+#define TIER_VALUES 4  /* Constants followed through a register at most */
+
+/* What an exit from optimized code by a jump adds to the PC it returns, so
+ * the dispatcher spends fuel on it */
+#define TIER_JUMPED ((uint64_t)1 << 32)
+
+/* The tier's view of one VM's zero segment. Layout for utility.S. */
+typedef struct
+{
+    void **entry;          /* Optimized code for each PC, or NULL */
+    uint32_t *heat;        /* Jumps left before each PC is hot, or 0 once
+                            * it has optimized code */
+    uint32_t words;
+    const uint32_t *code;  /* The words the zero segment was compiled from */
+    bool owns_code;
+} Tier_T;
+
+extern bool tier_enabled;
+extern bool tier_tracing; /* Compiling with the tracer instead (see tracer.h) */
+
+/* Turn the tier on. False if the plugin is missing or LLVM fails. */
+bool tier_open(void);
+
+/* Turn the tier on with the tracer, which needs nothing loaded */
+void tier_open_tracer(void);
+
+Tier_T *tier_new(const uint32_t *code, uint32_t words, bool copy);
+
+void tier_free(Tier_T *t);
+
+/* Called from the dispatcher when the jump target pc turns hot */
+void tier_compile(Machine_T *m, uint32_t pc);
+
+/* The plugin. Compiles the region at pc of code, returning the function for
+ * Tier_T.entry, or NULL. */
+bool tier_llvm_open(void);
+
+void *tier_llvm_compile(const uint32_t *code, uint32_t words, uint32_t pc);
+
+#endif
@@ -0,0 +1,456 @@
+/**
+ * @file tier_llvm.c
+ * @brief
+ * The optimizing tier's compiler (see tier.h). Built on its own into the
+ * plugin umjit-tier.so, so only a JIT run with -O loads LLVM.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "tier.h"
+
+#include <pthread.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Error.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+#include <llvm-c/Transforms/PassBuilder.h>
+
+/* ORC is shared by every VM, and compiles one region at a time */
+static pthread_mutex_t tier_lock = PTHREAD_MUTEX_INITIALIZER;
+static LLVMOrcLLJITRef lljit;
+static LLVMTargetMachineRef target;
+static uint64_t regions;
+
+typedef struct
+{
+    LLVMBuilderRef b;
+    LLVMTypeRef i8;
+    LLVMTypeRef i32;
+    LLVMTypeRef i64;
+    LLVMValueRef fn;
+    LLVMValueRef regs[8]; /* Allocas, which the -O2 pipeline turns into SSA */
+    LLVMValueRef fuel;
+    LLVMValueRef result;
+    LLVMValueRef umem;
+    LLVMBasicBlockRef exit;
+
+    const uint32_t *code;
+    uint32_t words;
+    uint32_t start[TIER_BLOCKS];
+    LLVMBasicBlockRef blocks[TIER_BLOCKS];
+    LLVMBasicBlockRef enter[TIER_BLOCKS]; /* Spends fuel, then the block */
+    uint32_t count;
+    LLVMValueRef switches[TIER_BLOCKS];   /* Jumps to computed targets */
+    uint32_t computed;
+    bool inside; /* Some jump stays in the region */
+} Region_T;
+
+/* The constants a register may hold, as far as the block has seen. The
+ * common UM idiom for a branch picks one of two loaded targets with a
+ * Conditional Move. */
+typedef struct
+{
+    uint32_t n; /* 0 for anything at all */
+    uint32_t v[TIER_VALUES];
+} Values_T;
+
+static bool failed(LLVMErrorRef err)
+{
+    if (err == NULL)
+        return false;
+
+    char *msg = LLVMGetErrorMessage(err);
+    fprintf(stderr, "Optimizing tier: %s\n", msg);
+    LLVMDisposeErrorMessage(msg);
+    return true;
+}
+
+bool tier_llvm_open(void)
+{
+    pthread_mutex_lock(&tier_lock);
+    if (lljit == NULL)
+    {
+        LLVMInitializeNativeTarget();
+        LLVMInitializeNativeAsmPrinter();
+
+        char *triple = LLVMGetDefaultTargetTriple();
+        char *cpu = LLVMGetHostCPUName();
+        char *features = LLVMGetHostCPUFeatures();
+        LLVMTargetRef t;
+        if (LLVMGetTargetFromTriple(triple, &t, NULL) == 0)
+            target = LLVMCreateTargetMachine(t, triple, cpu, features,
+                                             LLVMCodeGenLevelDefault,
+                                             LLVMRelocDefault,
+                                             LLVMCodeModelJITDefault);
+        LLVMDisposeMessage(triple);
+        LLVMDisposeMessage(cpu);
+        LLVMDisposeMessage(features);
+
+        if (target == NULL || failed(LLVMOrcCreateLLJIT(&lljit, NULL)))
+            lljit = NULL;
+    }
+
+    bool ok = lljit != NULL;
+    pthread_mutex_unlock(&tier_lock);
+    return ok;
+}
+
+/* A pointer to the field at offset in the Machine_T */
+static LLVMValueRef field(Region_T *r, LLVMTypeRef type, unsigned offset)
+{
+    LLVMValueRef m = LLVMGetParam(r->fn, 0);
+    LLVMValueRef off = LLVMConstInt(r->i64, offset, false);
+    LLVMValueRef p = LLVMBuildGEP2(r->b, r->i8, m, &off, 1, "");
+    return LLVMBuildBitCast(r->b, p, LLVMPointerType(type, 0), "");
+}
+
+static LLVMValueRef get(Region_T *r, unsigned reg)
+{
+    return LLVMBuildLoad2(r->b, r->i32, r->regs[reg], "");
+}
+
+static void set(Region_T *r, unsigned reg, LLVMValueRef v)
+{
+    LLVMBuildStore(r->b, v, r->regs[reg]);
+}
+
+static void leave(Region_T *r, LLVMValueRef next)
+{
+    LLVMBuildStore(r->b, next, r->result);
+    LLVMBuildBr(r->b, r->exit);
+}
+
+static void leave_at(Region_T *r, uint64_t next)
+{
+    leave(r, LLVMConstInt(r->i64, next, false));
+}
+
+/* The word at segment b, offset c, as the baseline code addresses it */
+static LLVMValueRef address(Region_T *r, LLVMValueRef b, LLVMValueRef c)
+{
+    LLVMValueRef off = LLVMBuildZExt(r->b, b, r->i64, "");
+    LLVMValueRef seg = LLVMBuildGEP2(r->b, r->i8, r->umem, &off, 1, "");
+    seg = LLVMBuildBitCast(r->b, seg, LLVMPointerType(r->i32, 0), "");
+    LLVMValueRef index = LLVMBuildZExt(r->b, c, r->i64, "");
+    return LLVMBuildGEP2(r->b, r->i32, seg, &index, 1, "");
+}
+
+/* The way into the block starting at pc by a jump, adding the block to the
+ * region if there is room */
+static LLVMBasicBlockRef block_at(Region_T *r, uint32_t pc)
+{
+    for (uint32_t i = 0; i < r->count; i++)
+        if (r->start[i] == pc)
+            return r->enter[i];
+
+    if (r->count == TIER_BLOCKS || pc >= r->words)
+        return NULL;
+
+    r->start[r->count] = pc;
+    r->blocks[r->count] = LLVMAppendBasicBlock(r->fn, "");
+    r->enter[r->count] = LLVMAppendBasicBlock(r->fn, "");
+    return r->enter[r->count++];
+}
+
+/* A jump inside the region spends its fuel on the way in. The last unit is
+ * left for the dispatcher, which stops the VM when it spends it. */
+static void emit_enter(Region_T *r, uint32_t i)
+{
+    LLVMPositionBuilderAtEnd(r->b, r->enter[i]);
+    LLVMBasicBlockRef spend = LLVMAppendBasicBlock(r->fn, "");
+    LLVMBasicBlockRef out = LLVMAppendBasicBlock(r->fn, "");
+    LLVMValueRef fuel = LLVMBuildLoad2(r->b, r->i64, r->fuel, "");
+    LLVMValueRef low = LLVMBuildICmp(r->b, LLVMIntULE, fuel,
+                                     LLVMConstInt(r->i64, 1, false), "");
+    LLVMBuildCondBr(r->b, low, out, spend);
+
+    LLVMPositionBuilderAtEnd(r->b, out);
+    leave_at(r, r->start[i] | TIER_JUMPED);
+
+    LLVMPositionBuilderAtEnd(r->b, spend);
+    LLVMBuildStore(r->b,
+                   LLVMBuildSub(r->b, fuel, LLVMConstInt(r->i64, 1, false),
+                                ""),
+                   r->fuel);
+    LLVMBuildBr(r->b, r->blocks[i]);
+}
+
+static void jump(Region_T *r, uint32_t target)
+{
+    LLVMBasicBlockRef to = block_at(r, target);
+    if (to == NULL)
+        leave_at(r, target | TIER_JUMPED);
+    else
+        LLVMBuildBr(r->b, to);
+    r->inside = r->inside || to != NULL;
+}
+
+/* A jump to a register that may hold any of several targets goes through a
+ * switch over every block in the region, filled in once they are all known.
+ * Other targets leave. */
+static void computed_jump(Region_T *r, LLVMValueRef target, Values_T *c)
+{
+    for (uint32_t i = 0; i < c->n; i++)
+        r->inside = block_at(r, c->v[i]) != NULL || r->inside;
+
+    LLVMBasicBlockRef other = LLVMAppendBasicBlock(r->fn, "");
+    r->switches[r->computed++] = LLVMBuildSwitch(r->b, target, other, 0);
+
+    LLVMPositionBuilderAtEnd(r->b, other);
+    leave(r, LLVMBuildOr(r->b, LLVMBuildZExt(r->b, target, r->i64, ""),
+                         LLVMConstInt(r->i64, TIER_JUMPED, false), ""));
+}
+
+static void load_program(Region_T *r, uint32_t pc, unsigned b, unsigned c,
+                         Values_T *values)
+{
+    /* Another segment is left to the baseline Load Program */
+    if (values[b].n != 1 || values[b].v[0] != 0)
+    {
+        LLVMBasicBlockRef same = LLVMAppendBasicBlock(r->fn, "");
+        LLVMBasicBlockRef other = LLVMAppendBasicBlock(r->fn, "");
+        LLVMValueRef zero = LLVMBuildICmp(r->b, LLVMIntEQ, get(r, b),
+                                          LLVMConstInt(r->i32, 0, false), "");
+        LLVMBuildCondBr(r->b, zero, same, other);
+
+        LLVMPositionBuilderAtEnd(r->b, other);
+        leave_at(r, pc);
+        LLVMPositionBuilderAtEnd(r->b, same);
+    }
+
+    if (values[c].n == 1)
+        jump(r, values[c].v[0]);
+    else
+        computed_jump(r, get(r, c), &values[c]);
+}
+
+/* LLVM takes a zero divisor for undefined, so that case leaves for the
+ * baseline Divide, which fails on it */
+static void divide(Region_T *r, uint32_t pc, unsigned a, unsigned b,
+                   unsigned c)
+{
+    LLVMBasicBlockRef ok = LLVMAppendBasicBlock(r->fn, "");
+    LLVMBasicBlockRef zero = LLVMAppendBasicBlock(r->fn, "");
+    LLVMValueRef v = get(r, c);
+    LLVMBuildCondBr(r->b, LLVMBuildICmp(r->b, LLVMIntEQ, v,
+                                        LLVMConstInt(r->i32, 0, false), ""),
+                    zero, ok);
+
+    LLVMPositionBuilderAtEnd(r->b, zero);
+    leave_at(r, pc);
+    LLVMPositionBuilderAtEnd(r->b, ok);
+    set(r, a, LLVMBuildUDiv(r->b, get(r, b), v, ""));
+}
+
+/* What a Conditional Move of b into a leaves a holding */
+static void merge(Values_T *a, Values_T *b)
+{
+    if (a->n == 0 || b->n == 0 || a->n + b->n > TIER_VALUES)
+    {
+        a->n = 0;
+        return;
+    }
+
+    for (uint32_t i = 0; i < b->n; i++)
+    {
+        bool seen = false;
+        for (uint32_t j = 0; j < a->n; j++)
+            seen = seen || a->v[j] == b->v[i];
+        if (!seen)
+            a->v[a->n++] = b->v[i];
+    }
+}
+
+/* One basic block, up to the jump or call out that ends it */
+static void emit_block(Region_T *r, uint32_t i)
+{
+    LLVMPositionBuilderAtEnd(r->b, r->blocks[i]);
+
+    /* Values loaded since the block began, for resolving its jump */
+    Values_T values[8];
+    memset(values, 0, sizeof(values));
+
+    for (uint32_t pc = r->start[i];; pc++)
+    {
+        if (pc >= r->words)
+        {
+            leave_at(r, pc);
+            return;
+        }
+
+        uint32_t word = r->code[pc];
+        uint32_t op = word >> 28;
+        if (op == 13)
+        {
+            unsigned a = (word >> 25) & 0x7;
+            set(r, a, LLVMConstInt(r->i32, word & 0x1FFFFFF, false));
+            values[a].n = 1;
+            values[a].v[0] = word & 0x1FFFFFF;
+            continue;
+        }
+
+        unsigned a = (word >> 6) & 0x7;
+        unsigned b = (word >> 3) & 0x7;
+        unsigned c = word & 0x7;
+        LLVMValueRef v;
+
+        switch (op)
+        {
+        case 0:
+            v = LLVMBuildICmp(r->b, LLVMIntNE, get(r, c),
+                              LLVMConstInt(r->i32, 0, false), "");
+            set(r, a, LLVMBuildSelect(r->b, v, get(r, b), get(r, a), ""));
+            merge(&values[a], &values[b]);
+            continue;
+        case 1:
+            /* Volatile, so a Load whose value goes unused still fails on a
+             * bad address as the baseline's would */
+            v = LLVMBuildLoad2(r->b, r->i32, address(r, get(r, b), get(r, c)),
+                               "");
+            LLVMSetVolatile(v, true);
+            set(r, a, v);
+            break;
+        case 2:
+            LLVMBuildStore(r->b, get(r, c), address(r, get(r, a), get(r, b)));
+            break;
+        case 3:
+            set(r, a, LLVMBuildAdd(r->b, get(r, b), get(r, c), ""));
+            break;
+        case 4:
+            set(r, a, LLVMBuildMul(r->b, get(r, b), get(r, c), ""));
+            break;
+        case 5:
+            divide(r, pc, a, b, c);
+            break;
+        case 6:
+            v = LLVMBuildAnd(r->b, get(r, b), get(r, c), "");
+            set(r, a, LLVMBuildNot(r->b, v, ""));
+            break;
+        case 12:
+            load_program(r, pc, b, c, values);
+            return;
+        case 14:
+        case 15:
+            /* Invalid instructions do nothing, as in the baseline */
+            continue;
+        default:
+            /* Everything that calls out runs in the baseline code */
+            leave_at(r, pc);
+            return;
+        }
+
+        if (op != 2)
+            values[a].n = 0;
+    }
+}
+
+static LLVMValueRef build(Region_T *r, LLVMModuleRef mod, const char *name,
+                          uint32_t pc)
+{
+    LLVMContextRef ctx = LLVMGetModuleContext(mod);
+    r->i8 = LLVMInt8TypeInContext(ctx);
+    r->i32 = LLVMInt32TypeInContext(ctx);
+    r->i64 = LLVMInt64TypeInContext(ctx);
+    LLVMTypeRef ptr = LLVMPointerType(r->i8, 0);
+
+    /* uint64_t region(Machine_T *m): the next PC, plus TIER_JUMPED */
+    LLVMTypeRef type = LLVMFunctionType(r->i64, &ptr, 1, false);
+    r->fn = LLVMAddFunction(mod, name, type);
+    r->b = LLVMCreateBuilderInContext(ctx);
+
+    LLVMBasicBlockRef entry = LLVMAppendBasicBlock(r->fn, "");
+    r->exit = LLVMAppendBasicBlock(r->fn, "");
+    LLVMPositionBuilderAtEnd(r->b, entry);
+
+    for (unsigned i = 0; i < 8; i++)
+    {
+        r->regs[i] = LLVMBuildAlloca(r->b, r->i32, "");
+        LLVMValueRef from = field(r, r->i32, MACHINE_REGS + 4 * i);
+        set(r, i, LLVMBuildLoad2(r->b, r->i32, from, ""));
+    }
+    r->fuel = LLVMBuildAlloca(r->b, r->i64, "");
+    LLVMBuildStore(r->b,
+                   LLVMBuildLoad2(r->b, r->i64,
+                                  field(r, r->i64, MACHINE_FUEL), ""),
+                   r->fuel);
+    r->result = LLVMBuildAlloca(r->b, r->i64, "");
+    r->umem = LLVMBuildLoad2(r->b, ptr, field(r, ptr, MACHINE_UMEM), "");
+    block_at(r, pc);
+    LLVMBuildBr(r->b, r->blocks[0]);
+
+    /* Blocks are added as jumps reach them */
+    for (uint32_t i = 0; i < r->count; i++)
+    {
+        emit_enter(r, i);
+        emit_block(r, i);
+    }
+
+    for (uint32_t s = 0; s < r->computed; s++)
+        for (uint32_t i = 0; i < r->count; i++)
+            LLVMAddCase(r->switches[s], LLVMConstInt(r->i32, r->start[i],
+                                                     false),
+                        r->enter[i]);
+
+    LLVMPositionBuilderAtEnd(r->b, r->exit);
+    for (unsigned i = 0; i < 8; i++)
+        LLVMBuildStore(r->b, get(r, i),
+                       field(r, r->i32, MACHINE_REGS + 4 * i));
+    LLVMBuildStore(r->b, LLVMBuildLoad2(r->b, r->i64, r->fuel, ""),
+                   field(r, r->i64, MACHINE_FUEL));
+    LLVMBuildRet(r->b, LLVMBuildLoad2(r->b, r->i64, r->result, ""));
+
+    LLVMDisposeBuilder(r->b);
+    return r->fn;
+}
+
+static void *compile_region(const uint32_t *code, uint32_t words,
+                            uint32_t pc)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "region%lu", regions++);
+
+    LLVMOrcThreadSafeContextRef tsc = LLVMOrcCreateNewThreadSafeContext();
+    LLVMContextRef ctx = LLVMOrcThreadSafeContextGetContext(tsc);
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext(name, ctx);
+    LLVMSetTarget(mod, LLVMOrcLLJITGetTripleString(lljit));
+    LLVMSetDataLayout(mod, LLVMOrcLLJITGetDataLayoutStr(lljit));
+
+    Region_T r = {.code = code, .words = words, .count = 0};
+    build(&r, mod, name, pc);
+
+    /* A region that cannot save a single trip through the dispatcher is not
+     * worth what LLVM takes to compile it */
+    void *fn = NULL;
+    LLVMPassBuilderOptionsRef opts = LLVMCreatePassBuilderOptions();
+    bool ok = r.inside && !LLVMVerifyModule(mod, LLVMPrintMessageAction, NULL) &&
+              !failed(LLVMRunPasses(mod, "default<O2>", target, opts));
+    LLVMDisposePassBuilderOptions(opts);
+
+    /* ORC takes the module whether or not it is used */
+    LLVMOrcThreadSafeModuleRef tsm = LLVMOrcCreateNewThreadSafeModule(mod,
+                                                                      tsc);
+    LLVMOrcDisposeThreadSafeContext(tsc);
+
+    LLVMOrcExecutorAddress addr;
+    if (ok && !failed(LLVMOrcLLJITAddLLVMIRModule(
+                  lljit, LLVMOrcLLJITGetMainJITDylib(lljit), tsm)))
+    {
+        if (!failed(LLVMOrcLLJITLookup(lljit, &addr, name)))
+            fn = (void *)addr;
+    }
+    else
+        LLVMOrcDisposeThreadSafeModule(tsm);
+
+    return fn;
+}
+
+void *tier_llvm_compile(const uint32_t *code, uint32_t words, uint32_t pc)
+{
+    pthread_mutex_lock(&tier_lock);
+    void *fn = compile_region(code, words, pc);
+    pthread_mutex_unlock(&tier_lock);
+    return fn;
+}
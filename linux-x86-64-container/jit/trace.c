@@ -0,0 +1,100 @@
+#include "trace.h"
+#include <stdlib.h>
+
+bool trace_enabled = false;
+
+static FILE *trace_fp;
+static Trace_Record last;
+
+static inline uint32_t zigzag(uint32_t delta)
+{
+    return (delta << 1) ^ (uint32_t)((int32_t)delta >> 31);
+}
+
+static inline uint32_t unzigzag(uint32_t zz)
+{
+    return (zz >> 1) ^ -(zz & 1);
+}
+
+static inline void put_varint(uint32_t v)
+{
+    while (v >= 0x80)
+    {
+        putc((v & 0x7F) | 0x80, trace_fp);
+        v >>= 7;
+    }
+    putc(v, trace_fp);
+}
+
+static bool get_varint(FILE *fp, uint32_t *v)
+{
+    *v = 0;
+    for (unsigned shift = 0; shift < 35; shift += 7)
+    {
+        int c = getc(fp);
+        if (c == EOF)
+            return false;
+
+        *v |= (uint32_t)(c & 0x7F) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+
+    return false;
+}
+
+static void put_record(uint32_t head, uint32_t pc, uint32_t id)
+{
+    put_varint(head);
+    put_varint(zigzag(id - last.id));
+    put_varint(zigzag(pc - last.pc));
+    last.id = id;
+    last.pc = pc;
+}
+
+void trace_open(const char *path)
+{
+    trace_fp = fopen(path, "wb");
+    if (trace_fp == NULL)
+    {
+        fprintf(stderr, "File %s could not be opened.\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Traces run to millions of records, so buffer generously */
+    setvbuf(trace_fp, NULL, _IOFBF, 1 << 20);
+    fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, trace_fp);
+    last = (Trace_Record){0, 0, 0};
+    trace_enabled = true;
+}
+
+void trace_close(void)
+{
+    if (fclose(trace_fp) != 0)
+        fprintf(stderr, "Error: Could not write the allocation trace\n");
+    trace_fp = NULL;
+    trace_enabled = false;
+}
+
+void trace_map(uint32_t pc, uint32_t size, uint32_t id)
+{
+    put_record((size / sizeof(uint32_t)) << 1, pc, id);
+}
+
+void trace_unmap(uint32_t pc, uint32_t id)
+{
+    put_record(1, pc, id);
+}
+
+bool trace_read(FILE *fp, Trace_Record *r)
+{
+    uint32_t head, id, pc;
+    if (!get_varint(fp, &head) || !get_varint(fp, &id) ||
+        !get_varint(fp, &pc))
+        return false;
+
+    r->size = (head & 1) ? TRACE_UNMAP : (head >> 1) * sizeof(uint32_t);
+    r->id += unzigzag(id);
+    r->pc += unzigzag(pc);
+    return true;
+}
@@ -0,0 +1,44 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Allocation traces.
+ * ./jit -t file records every Map and Unmap of a run so the replay benchmark
+ * can drive Virt32 with the same workload later. A trace is TRACE_MAGIC
+ * followed by one record per call. A record is three varints: the kind and
+ * size (words << 1 for Map, 1 for Unmap), then the segment ID and the UM
+ * program counter, each as a zigzag delta from the previous record. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TRACE_MAGIC "UMTRACE1"
+#define TRACE_MAGIC_LEN 8
+
+/* Map sizes are whole words, so this can never be a real size in bytes */
+#define TRACE_UNMAP 0xFFFFFFFF
+
+typedef struct
+{
+    uint32_t size; /* Bytes mapped, or TRACE_UNMAP */
+    uint32_t id;   /* Segment ID returned by Map, or passed to Unmap */
+    uint32_t pc;   /* UM program counter of the Map or Unmap */
+} Trace_Record;
+
+extern bool trace_enabled;
+
+/* Writing, for ./jit -t */
+void trace_open(const char *path);
+
+void trace_close(void);
+
+void trace_map(uint32_t pc, uint32_t size, uint32_t id);
+
+void trace_unmap(uint32_t pc, uint32_t id);
+
+/* Reading, for the replay benchmark. The deltas are taken from the previous
+ * record, so r must start zeroed and be passed back unchanged. Returns false
+ * at the end of the trace. */
+bool trace_read(FILE *fp, Trace_Record *r);
+
+#endif
@@ -0,0 +1,200 @@
+/**
+ * @file tracer.c
+ * @brief
+ * The tracing tier (see tracer.h): records the path a VM takes from a hot
+ * jump target, and compiles it with the block passes and the backend.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include "tracer.h"
+#include "ir.h"
+#include "opt.h"
+#include "lower.h"
+
+/* Compiled paths start this far into their mapping, after its length */
+#define HEADER 16
+
+/* The VM run ahead while recording, with the words it stored */
+typedef struct
+{
+    uint32_t regs[8];
+    uint8_t *umem;
+    uint8_t *at[TRACER_STORES];
+    uint32_t stored[TRACER_STORES];
+    unsigned stores;
+} Ahead_T;
+
+static uint8_t *address(const Ahead_T *v, uint32_t seg, uint32_t off)
+{
+    return v->umem + seg + (uint64_t)off * sizeof(uint32_t);
+}
+
+static uint32_t load(const Ahead_T *v, const uint8_t *at)
+{
+    for (unsigned i = v->stores; i-- > 0;)
+        if (v->at[i] == at)
+            return v->stored[i];
+
+    uint32_t word;
+    memcpy(&word, at, sizeof(word));
+    return word;
+}
+
+/* Run one instruction ahead, unless the path stops before it: it calls out,
+ * divides by zero, loads another segment or jumps out of this one */
+static bool step(Ahead_T *v, const Ir_Insn *in, uint32_t words)
+{
+    uint32_t *r = v->regs;
+    switch (in->op)
+    {
+    case IR_CMOV:
+        if (r[in->c] != 0)
+            r[in->a] = r[in->b];
+        return true;
+    case IR_LOAD:
+        r[in->a] = load(v, address(v, r[in->b], r[in->c]));
+        return true;
+    case IR_STORE:
+        if (v->stores == TRACER_STORES)
+            return false;
+        v->at[v->stores] = address(v, r[in->a], r[in->b]);
+        v->stored[v->stores++] = r[in->c];
+        return true;
+    case IR_ADD:
+        r[in->a] = r[in->b] + r[in->c];
+        return true;
+    case IR_MUL:
+        r[in->a] = r[in->b] * r[in->c];
+        return true;
+    case IR_DIV:
+        if (r[in->c] == 0)
+            return false;
+        r[in->a] = r[in->b] / r[in->c];
+        return true;
+    case IR_NAND:
+        r[in->a] = ~(r[in->b] & r[in->c]);
+        return true;
+    case IR_CONST:
+        r[in->a] = in->value;
+        return true;
+    case IR_NOP:
+        return true;
+    case IR_JUMP:
+        return r[in->b] == 0 && r[in->c] < words;
+    default:
+        return false;
+    }
+}
+
+/* Record the path from start into path. False if it makes no jumps, which
+ * the baseline code runs as well, or never comes back to start: entering a
+ * path saves and loads the whole machine, which a few blocks on the way to a
+ * call out do not make up for. */
+static bool record(const Tier_T *t, const Machine_T *m, uint32_t start,
+                   Path_T *path)
+{
+    Ahead_T *v = malloc(sizeof(Ahead_T));
+    assert(v != NULL);
+    memcpy(v->regs, m->regs, sizeof(v->regs));
+    v->umem = m->umem;
+    v->stores = 0;
+
+    Ir_Block *piece = NULL;
+    uint32_t pc = start, insns = 0;
+    bool jumped = false;
+    path->count = 0;
+    path->loops = false;
+
+    while (insns < TRACER_WORDS)
+    {
+        bool fresh = piece == NULL || piece->n == IR_MAX_BLOCK;
+        if (fresh && path->count == TRACER_PIECES)
+            break;
+
+        /* Running off the end of the segment is left to the slots */
+        Ir_Insn in = ir_decode(t->code[pc]);
+        if (in.op != IR_JUMP && pc + 1 == t->words)
+            break;
+        if (in.op == IR_JUMP)
+            in.value = v->regs[in.c];
+        if (!step(v, &in, t->words))
+            break;
+
+        if (fresh)
+        {
+            piece = &path->pieces[path->count++];
+            piece->start = pc;
+            piece->words = 0;
+            piece->n = 0;
+        }
+        piece->insns[piece->n++] = in;
+        piece->words++;
+        insns++;
+
+        if (in.op != IR_JUMP)
+        {
+            pc++;
+            continue;
+        }
+
+        jumped = true;
+        piece = NULL;
+        pc = in.value;
+        if (pc == start)
+        {
+            path->loops = true;
+            break;
+        }
+    }
+
+    path->exit = pc;
+    free(v);
+    return jumped && path->loops;
+}
+
+void *tracer_compile(const Tier_T *t, const Machine_T *m, uint32_t pc)
+{
+    Path_T path;
+    path.pieces = malloc(TRACER_PIECES * sizeof(Ir_Block));
+    assert(path.pieces != NULL);
+
+    uint8_t *fn = NULL;
+    if (record(t, m, pc, &path))
+    {
+        for (uint32_t i = 0; i < path.count; i++)
+        {
+            opt_constants(&path.pieces[i]);
+            opt_logic(&path.pieces[i]);
+            opt_memory(&path.pieces[i]);
+            opt_dead(&path.pieces[i]);
+        }
+
+        size_t size;
+        uint8_t *code = lower_path(&path, &size);
+        size_t len = HEADER + size;
+        uint8_t *map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(map != MAP_FAILED);
+        memcpy(map, &len, sizeof(len));
+        memcpy(map + HEADER, code, size);
+        free(code);
+
+        int result = mprotect(map, len, PROT_READ | PROT_EXEC);
+        assert(result == 0);
+        fn = map + HEADER;
+    }
+
+    free(path.pieces);
+    return fn;
+}
+
+void tracer_free(void *fn)
+{
+    uint8_t *map = (uint8_t *)fn - HEADER;
+    size_t len;
+    memcpy(&len, map, sizeof(len));
+    munmap(map, len);
+}
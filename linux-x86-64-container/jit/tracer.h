@@ -0,0 +1,30 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+/* Tracing tier, not to be confused with the allocation traces of trace.h.
+ * Turned on with ./jit -T, in place of the LLVM tier (see tier.h), whose
+ * jump counts and entries it shares. Once a target has been jumped to
+ * TRACER_HOT times, the tracer records the path the program takes from there
+ * by running it ahead on a copy of its registers, reading memory but keeping
+ * its own stores aside. It follows every jump, and stops where the path
+ * comes back to its start, reaches an instruction that calls out or gets too
+ * long. The path is run through the block passes (see opt.h) a piece at a
+ * time and compiled straight through, with each jump on it checked to go
+ * where it went while recording (see lower_path in lower.h). A path that
+ * came back runs as a loop until a check fails or the fuel runs low; one
+ * that did not is dropped, and its target never traced again. */
+
+#include "tier.h"
+
+#define TRACER_HOT 1000   /* Jumps to a target before it is traced */
+#define TRACER_PIECES 64  /* Pieces of code in a path at most */
+#define TRACER_WORDS 4096 /* Instructions in a path at most */
+#define TRACER_STORES 256 /* Stores a recording keeps aside at most */
+
+/* The path from pc, compiled, for Tier_T.entry, or NULL if it goes nowhere
+ * worth compiling. m is the VM as it jumps to pc. */
+void *tracer_compile(const Tier_T *t, const Machine_T *m, uint32_t pc);
+
+void tracer_free(void *fn);
+
+#endif
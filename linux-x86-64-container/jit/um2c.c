@@ -0,0 +1,318 @@
+/**
+ * @file um2c.c
+ * @brief
+ * Static recompiler. Translates a UM program into a C file that runs it, for
+ * an optimizing C compiler to finish. Every instruction becomes a statement
+ * on eight local registers, so the C compiler does register allocation,
+ * scheduling and folding across whole basic blocks. Jumps to targets loaded
+ * just before them become gotos; any other jump goes through a switch over
+ * every PC that can be a target. What the translation cannot run it hands to
+ * the JIT, which is linked in (see um2c.h). Build the output with
+ *
+ *     cc -O3 -I jit program.c jit/libumjit.a -o program
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include "utility.h"
+
+/* Bytes of the image per line of the array that holds it */
+#define IMAGE_LINE 16
+
+typedef struct
+{
+    uint32_t *words;
+    uint32_t n;
+    uint8_t *bytes; /* The file, for the JIT */
+    size_t len;
+} Program_T;
+
+static bool load(const char *path, Program_T *prog)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return false;
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0 || st.st_size == 0 ||
+        st.st_size % sizeof(uint32_t) != 0)
+    {
+        fclose(fp);
+        return false;
+    }
+
+    prog->len = st.st_size;
+    prog->n = prog->len / sizeof(uint32_t);
+    prog->bytes = malloc(prog->len);
+    prog->words = malloc(prog->n * sizeof(uint32_t));
+    assert(prog->bytes != NULL && prog->words != NULL);
+
+    bool ok = fread(prog->bytes, 1, prog->len, fp) == prog->len;
+    fclose(fp);
+
+    for (uint32_t i = 0; i < prog->n; i++)
+    {
+        uint8_t *w = prog->bytes + i * sizeof(uint32_t);
+        prog->words[i] = ((uint32_t)w[0] << 24) | ((uint32_t)w[1] << 16) |
+                         ((uint32_t)w[2] << 8) | w[3];
+    }
+
+    return ok;
+}
+
+/* Where control can arrive other than by falling through: the start, every
+ * value a Load Value puts in a register that is also a PC, since that is how
+ * UM code makes jump targets, the instruction after every jump, where calls
+ * return, and every Input, where a waiting program resumes */
+static bool *find_labels(Program_T *prog)
+{
+    bool *label = calloc(prog->n, sizeof(bool));
+    assert(label != NULL);
+    label[0] = true;
+
+    for (uint32_t i = 0; i < prog->n; i++)
+    {
+        uint32_t word = prog->words[i];
+        uint32_t op = word >> 28;
+        if (op == 13 && (word & 0x1FFFFFF) < prog->n)
+            label[word & 0x1FFFFFF] = true;
+        else if (op == 11)
+            label[i] = true;
+        else if (op == 12 && i + 1 < prog->n)
+            label[i + 1] = true;
+    }
+
+    return label;
+}
+
+/* A Load Program, as a goto where b is known to be 0 and c is known */
+static void emit_jump(FILE *out, uint32_t pc, unsigned b, unsigned c,
+                      const bool *known, const uint32_t *value,
+                      const bool *label, uint32_t n)
+{
+    bool zero = known[b] && value[b] == 0;
+    if (!zero)
+        fprintf(out,
+                "    if (r%u != 0)\n"
+                "    {\n"
+                "        SAVE(%u);\n"
+                "        load_program(r%u, umem, m);\n"
+                "        m->pc = r%u;\n"
+                "        return 0;\n"
+                "    }\n",
+                b, pc, b, c);
+
+    if (zero && known[c] && value[c] < n && label[value[c]])
+        fprintf(out, "    goto L%u;\n", value[c]);
+    else
+        fprintf(out, "    pc = r%u;\n    goto dispatch;\n", c);
+}
+
+static void emit_instruction(FILE *out, uint32_t pc, uint32_t word,
+                             bool *known, uint32_t *value, const bool *label,
+                             uint32_t n)
+{
+    uint32_t op = word >> 28;
+    if (op == 13)
+    {
+        unsigned a = (word >> 25) & 0x7;
+        fprintf(out, "    r%u = %uu;\n", a, word & 0x1FFFFFF);
+        known[a] = true;
+        value[a] = word & 0x1FFFFFF;
+        return;
+    }
+
+    unsigned a = (word >> 6) & 0x7;
+    unsigned b = (word >> 3) & 0x7;
+    unsigned c = word & 0x7;
+
+    switch (op)
+    {
+    case 0:
+        fprintf(out, "    if (r%u)\n        r%u = r%u;\n", c, a, b);
+        break;
+    case 1:
+        /* Volatile, so a Load whose value goes unused still fails on a bad
+         * address */
+        fprintf(out, "    r%u = ((volatile uint32_t *)(umem + r%u))[r%u];\n",
+                a, b, c);
+        break;
+    case 2:
+        fprintf(out, "    ((uint32_t *)(umem + r%u))[r%u] = r%u;\n", a, b, c);
+        break;
+    case 3:
+        fprintf(out, "    r%u = r%u + r%u;\n", a, b, c);
+        break;
+    case 4:
+        fprintf(out, "    r%u = r%u * r%u;\n", a, b, c);
+        break;
+    case 5:
+        /* C leaves a zero divisor undefined, so the JIT's Divide fails on it */
+        fprintf(out,
+                "    if (r%u == 0)\n"
+                "    {\n"
+                "        SAVE(%u);\n"
+                "        return 0;\n"
+                "    }\n"
+                "    r%u = r%u / r%u;\n",
+                c, pc, a, b, c);
+        break;
+    case 6:
+        fprintf(out, "    r%u = ~(r%u & r%u);\n", a, b, c);
+        break;
+    case 7:
+        fprintf(out, "    SAVE(%u);\n    return MACHINE_HALTED;\n", pc);
+        break;
+    case 8:
+        fprintf(out, "    r%u = map_segment(r%u, umem, %luu);\n", b, c,
+                (unsigned long)pc * CHUNK);
+        break;
+    case 9:
+        fprintf(out, "    unmap_segment(r%u, umem, %luu);\n", c,
+                (unsigned long)pc * CHUNK);
+        break;
+    case 10:
+        fprintf(out, "    print_out(r%u, m);\n", c);
+        break;
+    case 11:
+        fprintf(out,
+                "    in = read_char(m);\n"
+                "    if (in < 0)\n"
+                "    {\n"
+                "        SAVE(%u);\n"
+                "        return MACHINE_WAITING;\n"
+                "    }\n"
+                "    r%u = (uint32_t)in;\n",
+                pc, c);
+        break;
+    case 12:
+        emit_jump(out, pc, b, c, known, value, label, n);
+        break;
+    default:
+        /* Invalid instructions do nothing, as in the JIT */
+        return;
+    }
+
+    /* What the instruction wrote is no longer known */
+    if (op == 0 || op == 1 || (op >= 3 && op <= 6))
+        known[a] = false;
+    else if (op == 8)
+        known[b] = false;
+    else if (op == 11)
+        known[c] = false;
+}
+
+static void emit(FILE *out, Program_T *prog)
+{
+    bool *label = find_labels(prog);
+
+    fprintf(out, "/* Translated from a UM program by um2c */\n\n"
+                 "#include <stdlib.h>\n"
+                 "#include \"um2c.h\"\n\n"
+                 "#define SAVE(at) \\\n"
+                 "    (m->regs[0] = r0, m->regs[1] = r1, m->regs[2] = r2, "
+                 "m->regs[3] = r3, \\\n"
+                 "     m->regs[4] = r4, m->regs[5] = r5, m->regs[6] = r6, "
+                 "m->regs[7] = r7, \\\n"
+                 "     m->pc = (at))\n\n");
+
+    fprintf(out, "static const uint8_t image[%zu] = {", prog->len);
+    for (size_t i = 0; i < prog->len; i++)
+        fprintf(out, "%s0x%02x,", i % IMAGE_LINE == 0 ? "\n    " : " ",
+                prog->bytes[i]);
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "static uint32_t translated(Machine_T *m)\n"
+                 "{\n"
+                 "    uint8_t *const umem = m->umem;\n"
+                 "    uint32_t r0 = m->regs[0], r1 = m->regs[1], "
+                 "r2 = m->regs[2], r3 = m->regs[3];\n"
+                 "    uint32_t r4 = m->regs[4], r5 = m->regs[5], "
+                 "r6 = m->regs[6], r7 = m->regs[7];\n"
+                 "    uint32_t pc = m->pc;\n"
+                 "    int64_t in;\n"
+                 "    (void)umem;\n"
+                 "    (void)in;\n"
+                 "    goto dispatch;\n\n");
+
+    /* Values loaded since the last label, for resolving jumps */
+    bool known[8] = {false};
+    uint32_t value[8] = {0};
+
+    for (uint32_t i = 0; i < prog->n; i++)
+    {
+        if (label[i])
+        {
+            fprintf(out, "L%u:\n", i);
+            memset(known, 0, sizeof(known));
+        }
+        emit_instruction(out, i, prog->words[i], known, value, label,
+                         prog->n);
+    }
+
+    /* Off the end, and jumps to PCs with no label, go to the JIT */
+    fprintf(out, "    pc = %u;\n"
+                 "dispatch:\n"
+                 "    switch (pc)\n"
+                 "    {\n",
+            prog->n);
+    for (uint32_t i = 0; i < prog->n; i++)
+        if (label[i])
+            fprintf(out, "    case %u:\n        goto L%u;\n", i, i);
+    fprintf(out, "    default:\n"
+                 "        SAVE(pc);\n"
+                 "        return 0;\n"
+                 "    }\n"
+                 "}\n\n");
+
+    fprintf(out, "int main(void)\n"
+                 "{\n"
+                 "    Umjit_T *vm = umjit_new();\n"
+                 "    if (umjit_load(vm, image, sizeof(image)) != 0)\n"
+                 "        return EXIT_FAILURE;\n\n"
+                 "    umjit_run_static(vm, translated);\n"
+                 "    umjit_free(&vm);\n"
+                 "    return 0;\n"
+                 "}\n");
+
+    free(label);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3)
+    {
+        fprintf(stderr, "Usage: ./um2c [executable.um] [output.c]\n");
+        return EXIT_FAILURE;
+    }
+
+    Program_T prog;
+    if (!load(argv[1], &prog))
+    {
+        fprintf(stderr, "File %s could not be opened.\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *out = argc == 3 ? fopen(argv[2], "w") : stdout;
+    if (out == NULL)
+    {
+        fprintf(stderr, "File %s could not be written.\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    emit(out, &prog);
+    if (out != stdout && fclose(out) != 0)
+    {
+        fprintf(stderr, "File %s could not be written.\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    free(prog.words);
+    free(prog.bytes);
+    return 0;
+}
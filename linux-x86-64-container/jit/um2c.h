@@ -0,0 +1,35 @@
+#ifndef UM2C_H
+#define UM2C_H
+
+/* Runtime for C translated from UM programs by um2c.
+ * A translated program is a function that runs the VM's original program
+ * from m->pc with the registers in m->regs. It saves both and returns when
+ * the program halts or waits on input, returning MACHINE_HALTED or
+ * MACHINE_WAITING, or 0 when it reaches something only the JIT can run: a
+ * Load Program of another segment, a jump to a PC it has no label for, or a
+ * Divide by zero. The JIT then carries on from m->pc. Translated code assumes direct
+ * addressing. */
+
+#include "umjit.h"
+#include "utility.h"
+
+typedef uint32_t (*Static_Fn)(Machine_T *m);
+
+/* Run a loaded VM through its translation, then the JIT. Returns what
+ * umjit_run does. */
+int umjit_run_static(Umjit_T *vm, Static_Fn fn);
+
+/* The JIT's handlers, which translated code calls for the same work. Those
+ * that take a code offset want the instruction's PC times CHUNK. */
+uint32_t map_segment(uint32_t size, uint8_t *umem, size_t code_offset);
+
+void unmap_segment(uint32_t segment, uint8_t *umem, size_t code_offset);
+
+void print_out(uint32_t x, Machine_T *m);
+
+/* The next input byte, all ones at end of input, or -1 to wait */
+int64_t read_char(Machine_T *m);
+
+void *load_program(uint32_t b_val, uint8_t *umem, Machine_T *m);
+
+#endif
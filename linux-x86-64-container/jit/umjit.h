@@ -0,0 +1,178 @@
+#ifndef UMJIT_H
+#define UMJIT_H
+
+/* libumjit: the UM JIT as a library.
+ * A Umjit_T is one virtual machine with its own Virt32 memory system and
+ * compiled code, so a program can stay resident and serve many runs. VMs are
+ * independent and may run on separate threads. Input and output go through
+ * a Umjit_IO channel, which is stdin and stdout unless the caller says
+ * otherwise. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Umjit_T Umjit_T;
+typedef struct Umjit_Program_T Umjit_Program_T;
+
+/* Why a run returned */
+#define UMJIT_HALTED 1
+#define UMJIT_OUT_OF_FUEL 2
+#define UMJIT_KILLED 3
+#define UMJIT_WAITING 4
+
+/* What a non-blocking channel's get returns when no input has arrived yet */
+#define UMJIT_WOULD_BLOCK (-2)
+
+/* An I/O channel. get returns the next input byte, or EOF once there is no
+ * more input; put takes one output byte. cl is passed to both. A get that
+ * returns UMJIT_WOULD_BLOCK suspends the VM on its Input instruction: the
+ * run returns UMJIT_WAITING, and the next run retries the Input. */
+typedef struct
+{
+    int (*get)(void *cl);
+    void (*put)(uint8_t c, void *cl);
+    void *cl;
+} Umjit_IO;
+
+/* Memory buffers for a channel. Input is read from in[in_pos, in_len).
+ * Output is appended to out, which grows with realloc and belongs to the
+ * caller. */
+typedef struct
+{
+    const uint8_t *in;
+    size_t in_len;
+    size_t in_pos;
+    uint8_t *out;
+    size_t out_len;
+    size_t out_cap;
+} Umjit_Buffers;
+
+Umjit_IO umjit_stdio(void);
+
+Umjit_IO umjit_buffer_io(Umjit_Buffers *buffers);
+
+/* VM lifetime */
+Umjit_T *umjit_new(void);
+
+void umjit_free(Umjit_T **vm);
+
+void umjit_set_io(Umjit_T *vm, Umjit_IO io);
+
+/* Load a program from a .um file, or from its contents in memory (big-endian
+ * 32 bit words). Loading compiles the program and leaves the VM ready to run
+ * it from the start. Returns 0, or -1 if the file cannot be read or is not a
+ * whole number of words. */
+int umjit_load_file(Umjit_T *vm, const char *path);
+
+int umjit_load(Umjit_T *vm, const uint8_t *image, size_t len);
+
+/* Compiled programs, for running one program on many VMs. The compiled code
+ * is read-only, so any number of VMs on any number of threads may use a
+ * program at once; it must outlive them all. The compile functions return
+ * NULL where the load functions above fail. */
+Umjit_Program_T *umjit_compile_file(const char *path);
+
+Umjit_Program_T *umjit_compile(const uint8_t *image, size_t len);
+
+void umjit_program_free(Umjit_Program_T **prog);
+
+/* Load a compiled program into a VM without compiling it again. Returns 0,
+ * or -1 for a second program in indirect mode. */
+int umjit_use(Umjit_T *vm, Umjit_Program_T *prog);
+
+/* Run until the program halts. Returns UMJIT_HALTED, or UMJIT_WAITING. */
+int umjit_run(Umjit_T *vm);
+
+/* Run for at most 'jumps' Load Program instructions. Every UM jump is one,
+ * so this bounds any loop. Returns UMJIT_HALTED, or UMJIT_OUT_OF_FUEL if the
+ * budget ran out first, in which case the next run resumes where this one
+ * stopped. */
+int umjit_run_budget(Umjit_T *vm, uint64_t jumps);
+
+/* What the VM's last run returned, or 0 if it has not run since it was
+ * loaded or reset */
+int umjit_status(Umjit_T *vm);
+
+/* Stop the VM for good: every later run returns UMJIT_KILLED at once, until
+ * the VM is reset */
+void umjit_kill(Umjit_T *vm);
+
+/* Put the loaded program back in its starting state: registers cleared, all
+ * segments but the zero segment unmapped, and the original program in the
+ * zero segment. The compiled code is kept, so this costs no compile. Returns
+ * 0, or -1 in indirect mode, which cannot be reset. */
+int umjit_reset(Umjit_T *vm);
+
+/* Snapshots. umjit_snapshot writes everything needed to resume the VM
+ * between runs: registers, PC, the program and its arena. umjit_restore puts
+ * a VM in that state, mapping the arena copy-on-write from the file rather
+ * than reading it, so restoring a warmed-up program costs page faults rather
+ * than running it again. Code is compiled again on restore. Both return 0, or
+ * -1 on a file error, and neither works in indirect mode. A restore that
+ * fails leaves the VM reset on the snapshot's program, if it got that far. */
+int umjit_snapshot(Umjit_T *vm, const char *path);
+
+int umjit_restore(Umjit_T *vm, const char *path);
+
+/* Ahead-of-time compilation. umjit_aot writes a standalone executable to
+ * path: a copy of the running executable with the program and its compiled
+ * code appended. umjit_embedded returns the program the running executable
+ * carries, its code mapped from the file rather than compiled, or NULL if it
+ * carries none. Code that relies on a CPU feature the running machine lacks
+ * is compiled again from the program instead. The JIT stays in the
+ * executable for Load Program. umjit_aot returns 0, or -1 on a file error or
+ * in indirect mode. */
+int umjit_aot(Umjit_Program_T *prog, const char *path);
+
+Umjit_Program_T *umjit_embedded(void);
+
+/* M:N scheduling. A scheduler time-slices many VMs over a pool of worker
+ * threads: each turn runs one VM for 'slice' jumps, then puts it back on its
+ * worker's queue, and an idle worker steals from the others. A VM may move
+ * between threads from one slice to the next. Each VM is run until it halts
+ * or waits on input, or killed once it has used up the limit given when it
+ * was added (0 for no limit). Neither statistics nor tracing may be on while
+ * a scheduler runs. */
+typedef struct Umjit_Sched_T Umjit_Sched_T;
+
+Umjit_Sched_T *umjit_sched_new(unsigned threads, uint64_t slice);
+
+void umjit_sched_free(Umjit_Sched_T **sched);
+
+/* Add a loaded VM. It stays the caller's, and must not be touched until the
+ * scheduler has run. */
+void umjit_sched_add(Umjit_Sched_T *sched, Umjit_T *vm, uint64_t limit);
+
+/* Run every VM added so far until it halts or is killed, then return. Ask
+ * umjit_status which it was. */
+void umjit_sched_run(Umjit_Sched_T *sched);
+
+/* Fork server. Listens on a UNIX socket at path and, for each connection,
+ * forks a copy-on-write child that runs the loaded program from where the VM
+ * stands, with the connection as its stdin and stdout. A request therefore
+ * costs a fork rather than a load and compile. Returns -1 if the socket
+ * cannot be opened or the server fails; otherwise it serves forever. */
+int umjit_fork_server(Umjit_T *vm, const char *path);
+
+/* Process wide options, for the command line tool */
+
+/* Cache compiled code in dir, and map code found there instead of compiling
+ * it (see cache.h). Affects everything compiled after the call. */
+void umjit_use_cache(const char *dir);
+
+/* The same, in the shared memory object name (such as "/umjit"), shared with
+ * every process that uses it. Both caches may be used at once. */
+void umjit_share_cache(const char *name);
+
+/* Optimize hot code with LLVM (see tier.h) in every VM loaded after this.
+ * Returns 0, or -1 if the tier's plugin, built with LLVM, cannot be loaded. */
+int umjit_use_tier(void);
+
+/* Or trace hot paths and compile them natively instead (see tracer.h) */
+void umjit_use_tracer(void);
+
+/* Every VM created after this uses indirect addressing (see handles.h). The
+ * handle table is process wide, so only one such VM may exist at a time. */
+void umjit_use_indirect(void);
+
+#endif
@@ -10,8 +10,45 @@
 #define OP_DUPLICATE 5
 #define OP_HALT 6
 
+/* Machine_T layout, for utility.S */
+#define MACHINE_REGS 0
+#define MACHINE_PC 32
+#define MACHINE_STATUS 36
+#define MACHINE_CODE 40
+#define MACHINE_UMEM 48
+#define MACHINE_FUEL 56
+#define MACHINE_TIER 64
+#define MACHINE_WORDS 72
+
+/* Tier_T layout, for utility.S (see tier.h) */
+#define TIER_ENTRY 0
+#define TIER_HEAT 8
+#define TIER_WORDS 16
+
+/* Why run returned */
+#define MACHINE_HALTED 1
+#define MACHINE_OUT_OF_FUEL 2
+#define MACHINE_WAITING 4
+
 #ifndef __ASSEMBLER__
-    void run(uint8_t *zero, uint8_t *umem);
+    #include <stdint.h>
+
+    /* Everything run needs to start or resume a VM. Between calls to run the
+     * UM registers and program counter live here; while it runs they live in
+     * machine registers. */
+    typedef struct
+    {
+        uint32_t regs[8];
+        uint32_t pc;
+        uint32_t status;
+        uint8_t *code;  /* Compiled zero segment */
+        uint8_t *umem;  /* Virt32 usable base, or the handle table */
+        uint64_t fuel;  /* Load Programs left before run returns */
+        void *tier;     /* The optimizing tier's Tier_T, or NULL */
+        uint32_t words; /* In the compiled zero segment */
+    } Machine_T;
+
+    uint32_t run(Machine_T *m);
 #endif
 
 #endif
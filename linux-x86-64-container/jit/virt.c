@@ -1,54 +1,97 @@
 #include "virt.h"
+#include <stddef.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
-Mem_T *mem = NULL;
-uint8_t *usable = NULL;
-Stack_T *rec = NULL;
-uint32_t start_unused;
+/* utility.S works on the recycler and the memory context directly */
+_Static_assert(sizeof(Stack_T) == 1 << STACK_SHIFT, "Stack_T size");
+_Static_assert(offsetof(Stack_T, size) == STACK_SIZE_OFFSET,
+               "Stack_T.size");
+_Static_assert(offsetof(Stack_T, capacity) == STACK_CAP_OFFSET,
+               "Stack_T.capacity");
+_Static_assert(offsetof(Mem_T, recycler) == MEM_RECYCLER_OFFSET,
+               "Mem_T.recycler");
+_Static_assert(offsetof(Mem_T, start_unused) == MEM_START_UNUSED_OFFSET,
+               "Mem_T.start_unused");
+_Static_assert(offsetof(Mem_T, freed_bytes) == MEM_FREED_BYTES_OFFSET,
+               "Mem_T.freed_bytes");
+_Static_assert(offsetof(Mem_T, compact_at) == MEM_COMPACT_AT_OFFSET,
+               "Mem_T.compact_at");
+_Static_assert(sizeof(Mem_T) <= MEM_CTX_PAGE, "Mem_T size");
+
+/* The slow paths call these helpers out of line, so emit their definitions
+ * here */
+extern inline uint32_t get_idx_from_alloc_size(uint32_t size);
+extern inline uint32_t stack_top(Stack_T s);
+extern inline void stack_push(Stack_T *s, uint32_t elem);
+extern inline Stack_T stack_pop(Stack_T s);
+extern inline bool stack_is_empty(Stack_T s);
 
 static inline Stack_T stack_init(uint32_t size);
 
 static inline void stack_free(Stack_T s);
 
-uint8_t *init_memory_system(uint32_t kernel_size)
+Mem_T *init_memory_system(uint32_t kernel_size)
 {
-    /* Safely initialize the memory state */
-    assert(mem == NULL);
-    mem = (Mem_T *)malloc(sizeof(Mem_T));
-    assert(mem != NULL);
+    assert(kernel_size <= KERN_RESERVE);
 
-    /* Allocate 4 GB of contiguous virtual memory */
-    void *virt = mmap(NULL, GB4, PROT_READ | PROT_WRITE,
-                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    /* Allocate 4 GB of contiguous virtual memory, plus the page below it that
+     * holds the context and the guard above it */
+    void *ctx = mmap(NULL, MEM_CTX_PAGE + GB4 + ARENA_GUARD, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(ctx != MAP_FAILED);
+    int result = mprotect(ctx, MEM_CTX_PAGE + GB4, PROT_READ | PROT_WRITE);
+    assert(result == 0);
 
-    usable = ((uint8_t *)virt + BOOK_SIZE);
+    Mem_T *mem = ctx;
+    void *virt = (uint8_t *)ctx + MEM_CTX_PAGE;
 
     mem->mem = virt;
-    mem->usable_mem = (void *)((uint8_t *)virt + BOOK_SIZE);
-    rec = recycler_init();
-    mem->recycler = rec;
+    mem->usable_mem = (uint8_t *)virt + BOOK_SIZE;
+    mem->recycler = recycler_init();
 
     /* The kernel virtual size is 8 bytes smaller than its physical size */
     mem->kernel_virtual_size = kernel_size - BOOK_SIZE;
-    mem->begin_unused = kernel_size;
-    start_unused = kernel_size;
 
-    return usable;
+    /* The heap starts after the whole kernel reservation so the kernel can
+     * grow in place */
+    mem->begin_unused = KERN_RESERVE;
+    mem->start_unused = KERN_RESERVE;
+
+    mem->large = stack_init(INIT_STACK_SIZE);
+    mem->freed_bytes = 0;
+    mem->compact_at = COMPACT_MIN;
+    mem->mapped_bytes = 0;
+
+    assert(vs_context(mem->usable_mem) == mem);
+    return mem;
 }
 
-void terminate_memory_system(void)
+void terminate_memory_system(Mem_T *mem)
 {
-    /* Free the memory object statically defined within this file */
-    munmap(mem->mem, GB4);
-    free_recycler(rec);
+    free_recycler(mem->recycler);
+    stack_free(mem->large);
+
+    /* The context lives in the same mapping as the arena, so this goes last */
+    munmap(mem, MEM_CTX_PAGE + GB4 + ARENA_GUARD);
 }
 
 /* Kernel (Re)allocate (kern_realloc):
  * Overwrite the zero segment and initialize all memory to zero */
-uint32_t kern_realloc(uint32_t size)
+uint32_t kern_realloc(Mem_T *mem, uint32_t size)
 {
-    /* Ensure the kernel has enough space to fill the allocation */
-    assert(mem->kernel_virtual_size >= size);
+    /* Grow the kernel into its reservation if the new program needs it */
+    if (size > mem->kernel_virtual_size)
+    {
+        if (size > KERN_RESERVE - BOOK_SIZE)
+        {
+            fprintf(stderr, "Error: Program of %u bytes exceeds the kernel "
+                            "reservation\n", size);
+            exit(EXIT_FAILURE);
+        }
+
+        mem->kernel_virtual_size = size;
+    }
 
     /* Update the first 8 bytes of virtual memory with kernel bookkeeping */
     uint32_t *mem_start = (uint32_t *)mem->mem;
@@ -62,20 +105,560 @@ uint32_t kern_realloc(uint32_t size)
 
 /* Kernel Memory Copy (kern_memcpy):
  * Copies data from "userspace" to "kernel space" */
-void kern_memcpy(uint32_t src_addr, uint32_t copy_size)
+void kern_memcpy(Mem_T *mem, uint32_t src_addr, uint32_t copy_size)
 {
     /* This function will overwrite the kernel memory (segment 0). The user
      * does not control the destination this memory is copied to; the kernel
      * does. */
 
     /* Get real source and destination addresses to use with memcpy */
-    uint8_t *umem = usable;
+    uint8_t *umem = mem->usable_mem;
     void *real_src = convert_address(umem, src_addr);
     void *real_dest = convert_address(umem, 0);
     memcpy(real_dest, real_src, copy_size);
     return;
 }
 
+/* Hand the whole pages inside the virtual range [start, end) back to the OS.
+ * They read as zero the next time they are touched. */
+static void discard_pages(Mem_T *mem, uint32_t start, uint32_t end)
+{
+    uintptr_t page_start = (uintptr_t)convert_address(mem->usable_mem, start);
+    uintptr_t page_end = (uintptr_t)convert_address(mem->usable_mem, end);
+    page_start = (page_start + VIRT_PAGE_SIZE - 1) & ~(uintptr_t)(VIRT_PAGE_SIZE - 1);
+    page_end &= ~(uintptr_t)(VIRT_PAGE_SIZE - 1);
+
+    if (page_start >= page_end)
+        return;
+
+    /* Discarded snapshot pages would read back as the snapshot, so those are
+     * replaced with fresh anonymous memory instead */
+    uintptr_t mapped_end = (uintptr_t)mem->mem + mem->mapped_bytes;
+    if (page_start < mapped_end)
+    {
+        uintptr_t stop = page_end < mapped_end ? page_end : mapped_end;
+        void *p = mmap((void *)page_start, stop - page_start,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        assert(p != MAP_FAILED);
+        (void)p;
+        page_start = stop;
+    }
+
+    if (page_start < page_end)
+        madvise((void *)page_start, page_end - page_start, MADV_DONTNEED);
+}
+
+/* Align User (align_user):
+ * The lowest segment address at or above the free memory at sys_addr whose
+ * payload starts on an 'align' byte boundary in real memory. Usable memory
+ * begins BOOK_SIZE bytes into the page-aligned mapping, so an aligned segment
+ * address sits BOOK_SIZE bytes before a boundary in virtual memory. Any gap
+ * left in front of the segment's bookkeeping is big enough for a filler. */
+static uint64_t align_user(uint32_t sys_addr, uint32_t align)
+{
+    uint64_t user_start = (uint64_t)sys_addr + 2 * BOOK_SIZE + align - 1;
+    user_start -= user_start % align;
+    user_start -= BOOK_SIZE;
+
+    uint64_t gap = user_start - BOOK_SIZE - sys_addr;
+    if (gap != 0 && gap < BOOK_SIZE)
+        user_start += align;
+
+    return user_start;
+}
+
+/* Write a free segment header at sys_addr covering [sys_addr, end) and hand
+ * any whole pages inside it back to the OS */
+static void put_free_segment(Mem_T *mem, uint32_t sys_addr, uint32_t end)
+{
+    uint32_t *virt = convert_address(mem->usable_mem, sys_addr);
+    virt[0] = end - sys_addr - BOOK_SIZE;
+    virt[1] = SEG_FREE;
+    discard_pages(mem, sys_addr + BOOK_SIZE, end);
+}
+
+/* Cover [sys_addr, end) with a free filler segment so the heap stays walkable
+ * for compaction */
+static void carve_filler(Mem_T *mem, uint32_t sys_addr, uint32_t end)
+{
+    if (sys_addr == end)
+        return;
+
+    uint32_t *virt = convert_address(mem->usable_mem, sys_addr);
+    virt[0] = end - sys_addr - BOOK_SIZE;
+    virt[1] = SEG_FREE;
+    mem->freed_bytes += end - sys_addr;
+}
+
+/* Virtual Segment Carve, aligned path (vs_carve_aligned):
+ * Carve a fresh segment for one of the aligned buckets. The padding in front
+ * of it and the BOOK_SIZE bytes that bring its end back onto the block grid
+ * become fillers. */
+uint32_t vs_carve_aligned(Mem_T *mem, uint32_t size)
+{
+    uint8_t *umem = mem->usable_mem;
+    uint32_t index = get_idx_from_alloc_size(size);
+    uint32_t user_start = align_user(mem->start_unused, bucket_align(index));
+    uint32_t user_cap = ((index + 1) * BLOCK_SIZE) - BOOK_SIZE;
+    uint32_t user_end = user_start + user_cap;
+
+    carve_filler(mem, mem->start_unused, user_start - BOOK_SIZE);
+    carve_filler(mem, user_end, user_end + BOOK_SIZE);
+    mem->start_unused = user_end + BOOK_SIZE;
+
+    uint32_t *user_addr = convert_address(umem, user_start);
+    user_addr[-2] = user_cap;
+    user_addr[-1] = size;
+
+    return user_start;
+}
+
+/* Virtual Segment Calloc, large path (vs_calloc_large):
+ * Serve a segment bigger than MAX_ALLOC from a run of whole pages. The payload
+ * starts on a page boundary and the bookkeeping words sit just before it. */
+uint32_t vs_calloc_large(Mem_T *mem, uint32_t size)
+{
+    uint8_t *umem = mem->usable_mem;
+    uint32_t pages = ((uint64_t)size + VIRT_PAGE_SIZE - 1) / VIRT_PAGE_SIZE;
+    uint64_t cap = (uint64_t)pages * VIRT_PAGE_SIZE;
+
+    /* Reuse the tightest freed large segment that fits. Its pages were handed
+     * back to the OS when it was freed, so it already reads as zero. */
+    Stack_T *s = &mem->large;
+    uint32_t best = s->size;
+    uint32_t best_cap = 0;
+    for (uint32_t i = 0; i < s->size; i++)
+    {
+        uint32_t *seg = convert_address(umem, s->stack[i]);
+        if (seg[-2] >= cap && (best == s->size || seg[-2] < best_cap))
+        {
+            best = i;
+            best_cap = seg[-2];
+        }
+    }
+
+    if (best != s->size)
+    {
+        uint32_t freed_seg = s->stack[best];
+        s->stack[best] = s->stack[--s->size];
+
+        uint32_t *freed_seg_addr = convert_address(umem, freed_seg);
+        freed_seg_addr[-1] = size;
+        mem->freed_bytes -= freed_seg_addr[-2] + BOOK_SIZE;
+
+        if (stats_enabled)
+            stats_map(mem, freed_seg, true);
+        return freed_seg;
+    }
+
+    /* Otherwise carve a fresh run from the heap */
+    uint64_t user_start = align_user(mem->start_unused, VIRT_PAGE_SIZE);
+
+    if (user_start + cap > GB4 - BOOK_SIZE)
+    {
+        fprintf(stderr, "Error: Out of memory for a %u byte segment\n", size);
+        exit(EXIT_FAILURE);
+    }
+
+    carve_filler(mem, mem->start_unused, user_start - BOOK_SIZE);
+    mem->start_unused = user_start + cap;
+
+    uint32_t *user_addr = convert_address(umem, user_start);
+    user_addr[-2] = cap;
+    user_addr[-1] = size;
+
+    if (stats_enabled)
+        stats_map(mem, user_start, false);
+    return user_start;
+}
+
+/* Virtual Segment Free, large path (vs_free_large):
+ * Return a large segment's pages to the OS and keep its address range around
+ * for the next large allocation. */
+void vs_free_large(Mem_T *mem, uint32_t addr)
+{
+    uint32_t *seg = convert_address(mem->usable_mem, addr);
+    discard_pages(mem, addr, addr + seg[-2]);
+
+    seg[-1] = SEG_FREE;
+    mem->freed_bytes += seg[-2] + BOOK_SIZE;
+    stack_push(&mem->large, addr);
+}
+
+/* Zero the virtual range [start, end), discarding whole pages rather than
+ * writing to them */
+static void zero_range(Mem_T *mem, uint32_t start, uint32_t end)
+{
+    uint32_t page_start = start + VIRT_PAGE_SIZE - 1;
+    page_start -= (page_start + BOOK_SIZE) % VIRT_PAGE_SIZE;
+    uint32_t page_end = end - (end + BOOK_SIZE) % VIRT_PAGE_SIZE;
+
+    if (page_start >= page_end)
+    {
+        memset(convert_address(mem->usable_mem, start), 0, end - start);
+        return;
+    }
+
+    memset(convert_address(mem->usable_mem, start), 0, page_start - start);
+    discard_pages(mem, page_start, page_end);
+    memset(convert_address(mem->usable_mem, page_end), 0, end - page_end);
+}
+
+/* Cut the free range [start, end) into pieces from buckets that have no
+ * alignment to keep up. start is on the block grid; a tail too short for a
+ * block becomes a filler. */
+static void recycle_unaligned(Mem_T *mem, uint32_t start, uint32_t end)
+{
+    while (end - start >= BLOCK_SIZE)
+    {
+        uint32_t piece = end - start;
+        if (piece > LINE_ALIGN_IDX * BLOCK_SIZE)
+            piece = LINE_ALIGN_IDX * BLOCK_SIZE;
+        piece -= piece % BLOCK_SIZE;
+
+        put_free_segment(mem, start, start + piece);
+        stack_push(&mem->recycler[piece / BLOCK_SIZE - 1], start + BOOK_SIZE);
+
+        start += piece;
+    }
+
+    if (start < end)
+        put_free_segment(mem, start, end);
+}
+
+/* Hand a coalesced run of free memory [start, end) back to the recycler.
+ * The run is cut greedily into the biggest pieces that fit, each placed where
+ * its bucket's alignment demands: a page-aligned large segment if there is
+ * room, then page-aligned and line-aligned bucket pieces, then whatever is
+ * left over as small unaligned pieces. */
+static void recycle_run(Mem_T *mem, uint32_t start, uint32_t end)
+{
+    /* Runs that start at an aligned segment sit BOOK_SIZE bytes before the
+     * block grid */
+    if ((start + BOOK_SIZE) % BLOCK_SIZE != 0 && start < end)
+    {
+        put_free_segment(mem, start, start + BOOK_SIZE);
+        start += BOOK_SIZE;
+    }
+
+    while (start < end)
+    {
+        uint64_t user_start = align_user(start, VIRT_PAGE_SIZE);
+        uint64_t room = 0;
+        if (user_start + BOOK_SIZE < end)
+            room = end - user_start - BOOK_SIZE;
+
+        /* A large segment needs no filler after it */
+        uint64_t large_cap = (room + BOOK_SIZE) & ~(uint64_t)(VIRT_PAGE_SIZE - 1);
+        if (large_cap > MAX_ALLOC)
+        {
+            recycle_unaligned(mem, start, user_start - BOOK_SIZE);
+            put_free_segment(mem, user_start - BOOK_SIZE,
+                             user_start + large_cap);
+            stack_push(&mem->large, user_start);
+            start = user_start + large_cap;
+            continue;
+        }
+
+        uint32_t min_cap = (PAGE_ALIGN_IDX + 1) * BLOCK_SIZE - BOOK_SIZE;
+        uint32_t max_cap = MAX_ALLOC;
+        if (room < min_cap)
+        {
+            user_start = align_user(start, CACHE_LINE);
+            room = 0;
+            if (user_start + BOOK_SIZE < end)
+                room = end - user_start - BOOK_SIZE;
+
+            min_cap = (LINE_ALIGN_IDX + 1) * BLOCK_SIZE - BOOK_SIZE;
+            max_cap = PAGE_ALIGN_IDX * BLOCK_SIZE - BOOK_SIZE;
+        }
+
+        if (room < min_cap)
+        {
+            recycle_unaligned(mem, start, end);
+            return;
+        }
+
+        uint32_t cap = ((room + BOOK_SIZE) / BLOCK_SIZE) * BLOCK_SIZE - BOOK_SIZE;
+        if (cap > max_cap)
+            cap = max_cap;
+
+        recycle_unaligned(mem, start, user_start - BOOK_SIZE);
+        put_free_segment(mem, user_start - BOOK_SIZE, user_start + cap);
+        stack_push(&mem->recycler[(cap + BOOK_SIZE) / BLOCK_SIZE - 1],
+                   user_start);
+        put_free_segment(mem, user_start + cap, user_start + cap + BOOK_SIZE);
+        start = user_start + cap + BOOK_SIZE;
+    }
+}
+
+/* Virtual Segment Compact (vs_compact):
+ * Walk the heap, merge neighbouring free segments, give a free tail back to
+ * the OS and rebuild the recycler from what is left. */
+void vs_compact(Mem_T *mem)
+{
+    /* Every freed segment is about to be re-recycled from the walk */
+    for (uint32_t i = 0; i < REC_BUCKETS; i++)
+        if (mem->recycler[i].size != 0)
+            mem->recycler[i].size = 0;
+    mem->large.size = 0;
+
+    uint32_t run = 0;
+    bool in_run = false;
+    uint32_t sys_addr = mem->begin_unused;
+    while (sys_addr < mem->start_unused)
+    {
+        uint32_t *virt = convert_address(mem->usable_mem, sys_addr);
+        uint32_t next = sys_addr + BOOK_SIZE + virt[0];
+
+        if (virt[1] == SEG_FREE && !in_run)
+        {
+            run = sys_addr;
+            in_run = true;
+        }
+        else if (virt[1] != SEG_FREE && in_run)
+        {
+            recycle_run(mem, run, sys_addr);
+            in_run = false;
+        }
+
+        sys_addr = next;
+    }
+
+    /* The end of the heap is free, so stop carving from the top of it */
+    if (in_run)
+    {
+        /* Keep fresh carving on the 32 byte block grid */
+        uint32_t new_end = run;
+        if ((new_end + BOOK_SIZE) % BLOCK_SIZE != 0)
+        {
+            put_free_segment(mem, new_end, new_end + BOOK_SIZE);
+            new_end += BOOK_SIZE;
+        }
+
+        zero_range(mem, new_end, mem->start_unused);
+        mem->start_unused = new_end;
+    }
+
+    /* Recount what is still free */
+    mem->freed_bytes = 0;
+    sys_addr = mem->begin_unused;
+    while (sys_addr < mem->start_unused)
+    {
+        uint32_t *virt = convert_address(mem->usable_mem, sys_addr);
+        if (virt[1] == SEG_FREE)
+            mem->freed_bytes += virt[0] + BOOK_SIZE;
+        sys_addr += BOOK_SIZE + virt[0];
+    }
+
+    /* Wait for another half heap's worth of frees before the next pass, so
+     * fragmentation that cannot be merged away is not rescanned every time */
+    uint64_t heap_bytes = mem->start_unused - mem->begin_unused;
+    uint64_t next = mem->freed_bytes;
+    next += heap_bytes / 2 > COMPACT_MIN ? heap_bytes / 2 : COMPACT_MIN;
+    mem->compact_at = next > UINT32_MAX ? UINT32_MAX : next;
+}
+
+/* Virtual Segment Compact, when due (vs_compact_due):
+ * Called once freed_bytes reaches compact_at. Compacts if at least half the
+ * heap is free, and otherwise waits for half of the heap as it is now. */
+void vs_compact_due(Mem_T *mem)
+{
+    uint64_t heap_bytes = mem->start_unused - mem->begin_unused;
+    if ((uint64_t)mem->freed_bytes * 2 >= heap_bytes)
+        vs_compact(mem);
+    else
+        mem->compact_at = heap_bytes / 2;
+}
+
+/* Virtual Segment Reset (vs_reset):
+ * Drop every segment but the kernel and hand the heap's pages back to the OS,
+ * leaving the heap as init_memory_system made it */
+void vs_reset(Mem_T *mem)
+{
+    /* Unused buckets are left as untouched zero pages */
+    for (uint32_t i = 0; i < REC_BUCKETS; i++)
+        if (mem->recycler[i].size != 0)
+            mem->recycler[i].size = 0;
+    mem->large.size = 0;
+
+    zero_range(mem, mem->begin_unused, mem->start_unused);
+    mem->start_unused = mem->begin_unused;
+    mem->freed_bytes = 0;
+    mem->compact_at = COMPACT_MIN;
+}
+
+/* Snapshot layout, after a Snap_Header at the position it was written to:
+ * each recycler bucket in use as its index, its size and its entries, then
+ * REC_BUCKETS, then the large list as its size and entries. The arena pages
+ * follow at the next page boundary of the file, with unused pages left as
+ * holes. */
+typedef struct
+{
+    uint32_t kernel_virtual_size;
+    uint32_t begin_unused;
+    uint32_t start_unused;
+    uint32_t freed_bytes;
+    uint32_t compact_at;
+    uint32_t pad;
+    uint64_t pages_offset;
+    uint64_t pages_len;
+} Snap_Header;
+
+#define SNAP_WINDOW ((uint64_t)256 * VIRT_PAGE_SIZE)
+
+static bool write_stack(FILE *fp, Stack_T *s)
+{
+    return fwrite(&s->size, sizeof(uint32_t), 1, fp) == 1 &&
+           fwrite(s->stack, sizeof(uint32_t), s->size, fp) == s->size;
+}
+
+static bool read_stack(FILE *fp, Stack_T *s)
+{
+    uint32_t size;
+    if (fread(&size, sizeof(uint32_t), 1, fp) != 1)
+        return false;
+
+    for (uint32_t i = 0; i < size; i++)
+    {
+        uint32_t elem;
+        if (fread(&elem, sizeof(uint32_t), 1, fp) != 1)
+            return false;
+        stack_push(s, elem);
+    }
+
+    return true;
+}
+
+static bool page_is_zero(const uint64_t *page)
+{
+    for (uint32_t i = 0; i < VIRT_PAGE_SIZE / sizeof(uint64_t); i++)
+        if (page[i] != 0)
+            return false;
+    return true;
+}
+
+/* Write the pages of [base, base + len) that hold anything to fd at offset.
+ * Pages never touched are not resident, so mincore finds them without
+ * faulting them in. */
+static bool write_pages(int fd, uint8_t *base, uint64_t len, uint64_t offset)
+{
+    unsigned char resident[SNAP_WINDOW / VIRT_PAGE_SIZE];
+
+    for (uint64_t at = 0; at < len; at += SNAP_WINDOW)
+    {
+        uint64_t window = len - at < SNAP_WINDOW ? len - at : SNAP_WINDOW;
+        if (mincore(base + at, window, resident) != 0)
+            return false;
+
+        for (uint64_t page = 0; page < window; page += VIRT_PAGE_SIZE)
+        {
+            uint8_t *p = base + at + page;
+            if (!(resident[page / VIRT_PAGE_SIZE] & 1) ||
+                page_is_zero((uint64_t *)p))
+                continue;
+
+            if (pwrite(fd, p, VIRT_PAGE_SIZE, offset + at + page) !=
+                VIRT_PAGE_SIZE)
+                return false;
+        }
+    }
+
+    return ftruncate(fd, offset + len) == 0;
+}
+
+bool vs_snapshot(Mem_T *mem, FILE *fp)
+{
+    Snap_Header h = {mem->kernel_virtual_size, mem->begin_unused,
+                     mem->start_unused, mem->freed_bytes, mem->compact_at, 0,
+                     0, 0};
+
+    /* The arena from the kernel's bookkeeping to the end of the heap */
+    h.pages_len = ((uint64_t)BOOK_SIZE + mem->start_unused + VIRT_PAGE_SIZE - 1) &
+                  ~(uint64_t)(VIRT_PAGE_SIZE - 1);
+
+    long at = ftell(fp);
+    if (at < 0 || fwrite(&h, sizeof(h), 1, fp) != 1)
+        return false;
+
+    for (uint32_t i = 0; i < REC_BUCKETS; i++)
+    {
+        if (mem->recycler[i].size == 0)
+            continue;
+        if (fwrite(&i, sizeof(uint32_t), 1, fp) != 1 ||
+            !write_stack(fp, &mem->recycler[i]))
+            return false;
+    }
+
+    uint32_t end = REC_BUCKETS;
+    if (fwrite(&end, sizeof(uint32_t), 1, fp) != 1 ||
+        !write_stack(fp, &mem->large))
+        return false;
+
+    long pos = ftell(fp);
+    if (pos < 0 || fflush(fp) != 0)
+        return false;
+    h.pages_offset = ((uint64_t)pos + VIRT_PAGE_SIZE - 1) &
+                     ~(uint64_t)(VIRT_PAGE_SIZE - 1);
+
+    if (!write_pages(fileno(fp), mem->mem, h.pages_len, h.pages_offset))
+        return false;
+
+    /* Now that the pages are placed, the header can say where */
+    if (fseek(fp, at, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, fp) != 1)
+        return false;
+    return fseek(fp, h.pages_offset + h.pages_len, SEEK_SET) == 0;
+}
+
+bool vs_restore(Mem_T *mem, FILE *fp)
+{
+    Snap_Header h;
+    if (fread(&h, sizeof(h), 1, fp) != 1 || h.pages_len > GB4 ||
+        h.pages_offset % VIRT_PAGE_SIZE != 0)
+        return false;
+
+    uint32_t i;
+    for (;;)
+    {
+        if (fread(&i, sizeof(uint32_t), 1, fp) != 1)
+            return false;
+        if (i >= REC_BUCKETS)
+            break;
+        if (!read_stack(fp, &mem->recycler[i]))
+            return false;
+    }
+
+    if (!read_stack(fp, &mem->large))
+        return false;
+
+    void *p = mmap(mem->mem, h.pages_len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_FIXED, fileno(fp), h.pages_offset);
+    if (p == MAP_FAILED)
+        return false;
+
+    if (h.pages_len > mem->mapped_bytes)
+        mem->mapped_bytes = h.pages_len;
+    mem->kernel_virtual_size = h.kernel_virtual_size;
+    mem->begin_unused = h.begin_unused;
+    mem->start_unused = h.start_unused;
+    mem->freed_bytes = h.freed_bytes;
+    mem->compact_at = h.compact_at;
+
+    return fseek(fp, h.pages_offset + h.pages_len, SEEK_SET) == 0;
+}
+
+/* Fragmentation (vs_fragmentation):
+ * The share of the heap below start_unused that is not in use */
+double vs_fragmentation(Mem_T *mem)
+{
+    uint32_t heap_bytes = mem->start_unused - mem->begin_unused;
+    if (heap_bytes == 0)
+        return 0.0;
+
+    return (double)mem->freed_bytes / heap_bytes;
+}
+
 inline Stack_T stack_init(uint32_t size)
 {
     assert(size > 0);
@@ -93,17 +676,14 @@ inline void stack_free(Stack_T s)
     free(s.stack);
 }
 
+/* Buckets start empty with no stack; stack_push gives a bucket one the first
+ * time a segment of its size is freed. Until then the table is untouched zero
+ * pages, so an idle VM costs next to nothing. */
 Stack_T *recycler_init(void)
 {
-    Stack_T *recycler = malloc(sizeof(Stack_T) * REC_BUCKETS);
+    Stack_T *recycler = calloc(REC_BUCKETS, sizeof(Stack_T));
     assert(recycler != NULL);
 
-    for (uint32_t i = 0; i < REC_BUCKETS; i++)
-    {
-        Stack_T s = stack_init(INIT_STACK_SIZE);
-        recycler[i] = s;
-    }
-
     return recycler;
 }
 
@@ -4,26 +4,79 @@
 #define BOOK_SIZE 8
 #define MIN_SEG_SIZE 32
 
-/* The user can allocate at most 2^24 - 8 bytes. This means there are 2^19
- * different segment lengths a user can allocate, and we are going to use a
- * unique bucket to recycle each one. */
-#define MAX_ALLOC (((uint32_t)1 << 24) - BOOK_SIZE)
-#define KERN_SIZE MAX_ALLOC
+/* Segments of up to 2^24 - 8 bytes are served in 32 byte blocks. This means
+ * there are 2^19 different segment lengths on this path, and we are going to
+ * use a unique bucket to recycle each one. Anything larger is a large segment
+ * and gets its own run of pages instead. */
+#define MAX_ALLOC ((1 << 24) - BOOK_SIZE)
 #define REC_BUCKETS ((uint32_t)1 << 19) /* 2^19 recyclable segment lengths */
 
+/* The zero segment starts out with room for KERN_SIZE bytes, but may grow up
+ * to KERN_RESERVE bytes when a larger program is loaded. The heap begins after
+ * the reservation, so untouched kernel pages cost nothing but address space. */
+#define KERN_SIZE MAX_ALLOC
+#define KERN_RESERVE (((uint32_t)1 << 28) - BOOK_SIZE)
+
+#define VIRT_PAGE_SIZE ((uint32_t)1 << 12)
+#define CACHE_LINE 64
+
+/* Bigger segments are placed so their payload starts on a cache line (from
+ * 249 bytes) or a page (from 65529 bytes) in real memory. Alignment belongs to
+ * the recycler bucket, so a recycled segment is as aligned as a fresh one. */
+#define LINE_ALIGN_IDX 8
+#define PAGE_ALIGN_IDX 2048
+
 #define GB4 ((uint64_t)1 << 32) /* 4 GB = 2^32 */
+
+/* Generated code addresses a word as base + rB + 4 * rC, which can reach 16 GB
+ * past the arena. That much is reserved behind it with no access, so a wild
+ * Load or Store faults the same way whatever else the process has mapped. */
+#define ARENA_GUARD (4 * GB4)
+
+/* The largest segment the heap could hold if it were empty, in bytes. Map
+ * checks against this before a size goes through 32 bits. */
+#define MAX_SEGMENT (GB4 - KERN_RESERVE - VIRT_PAGE_SIZE)
 #define BOOK_SIZE 8
 #define BLOCK_SIZE 32
 
 #define INIT_STACK_SIZE 2
 #define SEG_NOT_FOUND 1
 
+/* Each memory system keeps its Mem_T in the page just below its 4 GB arena,
+ * so whatever holds the usable base (rcx in the generated code) reaches the
+ * context at a fixed offset */
+#define MEM_CTX_PAGE 4096
+#define MEM_FROM_USABLE (MEM_CTX_PAGE + BOOK_SIZE)
+
+/* Stack_T and Mem_T layout, for the map and unmap fast paths in utility.S */
+#define STACK_SHIFT 4
+#define STACK_SIZE_OFFSET 8
+#define STACK_CAP_OFFSET 12
+
+#define MEM_RECYCLER_OFFSET 16
+#define MEM_START_UNUSED_OFFSET 32
+#define MEM_FREED_BYTES_OFFSET 36
+#define MEM_COMPACT_AT_OFFSET 40
+
+/* A freed segment has this in place of its size, which is always a multiple
+ * of 4 for a live segment. This is how compaction tells live from free. */
+#define SEG_FREE 0xFFFFFFFF
+
+/* Compact the heap once at least this much of it is free, and at least half
+ * of it */
+#define COMPACT_MIN ((uint32_t)1 << 24)
+
+/* Everything below is C only; utility.S includes this file for the
+ * constants above */
+#ifndef __ASSEMBLER__
+
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include "stats.h"
 
 typedef struct
 {
@@ -32,25 +85,33 @@ typedef struct
     uint32_t capacity;
 } __attribute__((packed)) Stack_T;
 
-typedef struct
+/* One memory system. Every VM has its own, so any number of them can run side
+ * by side in one process. */
+typedef struct Mem_T
 {
-    void *mem;        /* Pointer to the full 4GB of memory */
-    void *usable_mem; /* Pointer to the beginning of usable memory */
-    void *recycler;   /* Array of stacks for recycling segments */
+    void *mem;           /* Pointer to the full 4GB of memory */
+    uint8_t *usable_mem; /* Pointer to the beginning of usable memory */
+    Stack_T *recycler;   /* Array of stacks for recycling segments */
     uint32_t kernel_virtual_size;
     uint32_t begin_unused;
+    uint32_t start_unused; /* Everything from here up is unused and zero */
+    uint32_t freed_bytes;  /* Heap bytes (bookkeeping included) not in use */
+    uint32_t compact_at;   /* Compact when freed_bytes reaches this */
+    Stack_T large;         /* Freed large segments waiting to be reused */
+    uint64_t mapped_bytes; /* Bytes of 'mem' backed by a restored snapshot */
 } Mem_T;
 
-extern uint8_t *usable;
-extern Stack_T *rec;
-extern Mem_T *mem;
-extern uint32_t start_unused;
-
 /* Memory utility functions */
 
 /* Using a macro is disgusting but the linker gave me no choice */
 #define convert_address(umem, addr) ((void *)((uint8_t *)umem + addr))
 
+/* The memory system that owns a usable base address */
+static inline Mem_T *vs_context(uint8_t *umem)
+{
+    return (Mem_T *)(umem - MEM_FROM_USABLE);
+}
+
 inline uint32_t get_idx_from_alloc_size(uint32_t size)
 {
     /* Will allocate 1 block when it gets an exact fit */
@@ -58,6 +119,13 @@ inline uint32_t get_idx_from_alloc_size(uint32_t size)
     return num_blocks;
 }
 
+static inline uint32_t bucket_align(uint32_t index)
+{
+    if (index >= PAGE_ALIGN_IDX)
+        return VIRT_PAGE_SIZE;
+    return CACHE_LINE;
+}
+
 /* Stack interface */
 inline uint32_t stack_top(Stack_T s)
 {
@@ -89,8 +157,8 @@ inline void stack_push(Stack_T *s, uint32_t elem)
 {
     if (s->size == s->capacity)
     {
-        /* Expand the stack */
-        s->capacity *= 2;
+        /* Expand the stack, or give an unused bucket its first one */
+        s->capacity = s->capacity ? 2 * s->capacity : INIT_STACK_SIZE;
         uint32_t *temp = malloc(s->capacity * sizeof(uint32_t));
         for (uint32_t i = 0; i < s->size; i++)
         {
@@ -158,11 +226,15 @@ inline uint32_t find_freed_segment(uint32_t size, Stack_T *rec)
 //     stack_push(&rec[index], seg_addr);
 // }
 
-inline void free_segment(uint8_t *umem, uint32_t seg_addr, Stack_T *rec)
+inline void free_segment(Mem_T *mem, uint32_t seg_addr)
 {
     uint32_t sys_addr = seg_addr - BOOK_SIZE;
-    uint32_t *virt = convert_address(umem, sys_addr);
+    uint32_t *virt = convert_address(mem->usable_mem, sys_addr);
     uint32_t cap = *virt;
+
+    /* Mark the segment free so compaction can find it */
+    virt[1] = SEG_FREE;
+    mem->freed_bytes += cap + BOOK_SIZE;
     
     // Calculate index safely
     uint32_t blocks = (cap + 8) / 32;
@@ -179,31 +251,59 @@ inline void free_segment(uint8_t *umem, uint32_t seg_addr, Stack_T *rec)
         return;
     }
     
-    stack_push(&rec[index], seg_addr);
+    stack_push(&mem->recycler[index], seg_addr);
 }
 
 /* Memory system interface */
 
-uint8_t *init_memory_system(uint32_t kernel_size);
+Mem_T *init_memory_system(uint32_t kernel_size);
 
-void terminate_memory_system(void);
+void terminate_memory_system(Mem_T *mem);
 
-uint32_t kern_realloc(uint32_t size);
+uint32_t kern_realloc(Mem_T *mem, uint32_t size);
 
-void kern_memcpy(uint32_t src_addr, uint32_t copy_size);
+void kern_memcpy(Mem_T *mem, uint32_t src_addr, uint32_t copy_size);
+
+/* Aligned bucket path, for fresh segments of LINE_ALIGN_IDX blocks and up */
+uint32_t vs_carve_aligned(Mem_T *mem, uint32_t size);
+
+/* Large segment path, for allocations above MAX_ALLOC */
+uint32_t vs_calloc_large(Mem_T *mem, uint32_t size);
+
+void vs_free_large(Mem_T *mem, uint32_t addr);
+
+/* Heap compaction. vs_compact_due runs vs_compact if half the heap is free
+ * by the time freed_bytes reaches compact_at. */
+void vs_compact(Mem_T *mem);
+
+void vs_compact_due(Mem_T *mem);
+
+double vs_fragmentation(Mem_T *mem);
+
+void vs_reset(Mem_T *mem);
+
+/* Snapshots. vs_snapshot writes the allocator state and the arena up to the
+ * end of the heap to fp, at its current position. vs_restore reads one back
+ * into a memory system that has just been reset, mapping the arena pages
+ * copy-on-write straight from the file. Both return false on a file error. */
+bool vs_snapshot(Mem_T *mem, FILE *fp);
+
+bool vs_restore(Mem_T *mem, FILE *fp);
 
 /* Virtual Segment Calloc (vs_calloc):
  * Carve out a segment of virtual memory and serve it to the program as
  * zeroed-out v^2 memory */
-static inline uint32_t vs_calloc(uint8_t *umem, uint32_t size)
+static inline uint32_t vs_calloc(Mem_T *mem, uint32_t size)
 {
-    /* Users may only ask vs_malloc for (2^24 - 8) bytes of contiguous space
-     * Omitted for performance reasons. The user must use our module correctly:
-     * assert(size < MAX_ALLOC); */
+    uint8_t *umem = mem->usable_mem;
+
+    /* Segments too big for the recycler buckets get their own pages */
+    if (size > MAX_ALLOC)
+        return vs_calloc_large(mem, size);
 
     /* Look for segments to be recycled. If there are freed segments that are
      * ready to be recycled, recycled them */
-    uint32_t freed_seg = find_freed_segment(size, rec);
+    uint32_t freed_seg = find_freed_segment(size, mem->recycler);
 
     /* check that a free segment is available */
     if (freed_seg != SEG_NOT_FOUND)
@@ -211,14 +311,25 @@ static inline uint32_t vs_calloc(uint8_t *umem, uint32_t size)
         uint32_t *freed_seg_addr = convert_address(umem, freed_seg);
 
         freed_seg_addr[-1] = size;
+        mem->freed_bytes -= freed_seg_addr[-2] + BOOK_SIZE;
 
         memset(freed_seg_addr, 0, size);
 
+        if (stats_enabled)
+            stats_map(mem, freed_seg, true);
         return freed_seg;
     }
 
     /* If no segments can be recycled, carve a fresh one from the heap */
-    uint32_t user_start = start_unused + BOOK_SIZE;
+    if (get_idx_from_alloc_size(size) >= LINE_ALIGN_IDX)
+    {
+        uint32_t aligned_seg = vs_carve_aligned(mem, size);
+        if (stats_enabled)
+            stats_map(mem, aligned_seg, false);
+        return aligned_seg;
+    }
+
+    uint32_t user_start = mem->start_unused + BOOK_SIZE;
 
     /* Find the number of 32 byte blocks need to fill the allocation */
     uint32_t num_blocks = get_idx_from_alloc_size(size) + 1;
@@ -230,22 +341,39 @@ static inline uint32_t vs_calloc(uint8_t *umem, uint32_t size)
      * assert(GB4 - (user_start + BOOK_SIZE) >= user_cap); */
 
     /* Update the beginning of the unused heap */
-    start_unused = user_start + user_cap;
+    mem->start_unused = user_start + user_cap;
 
     uint32_t *user_addr = convert_address(umem, user_start);
 
     user_addr[-2] = user_cap;
     user_addr[-1] = size;
 
+    if (stats_enabled)
+        stats_map(mem, user_start, false);
     return user_start;
 }
 
 /* Virtual Segment Free (vs_free):
  * Free a virtual segment for future use. */
-static inline void vs_free(uint32_t addr)
+static inline void vs_free(Mem_T *mem, uint32_t addr)
 {
-    // (void)addr;.
-    free_segment(usable, addr, rec);
+    uint32_t *seg = convert_address(mem->usable_mem, addr);
+
+    if (stats_enabled)
+        stats_unmap(mem, addr);
+
+    /* Only large segments have a capacity beyond the largest bucket */
+    if (seg[-2] > MAX_ALLOC)
+    {
+        vs_free_large(mem, addr);
+        return;
+    }
+
+    free_segment(mem, addr);
+
+    /* Compact once enough of the heap is sitting unused */
+    if (mem->freed_bytes >= mem->compact_at)
+        vs_compact_due(mem);
 }
 
 /* Set At (set_at):
@@ -264,4 +392,6 @@ inline uint32_t get_at(uint8_t *umem, uint32_t addr)
     return *src;
 }
 
+#endif /* __ASSEMBLER__ */
+
 #endif
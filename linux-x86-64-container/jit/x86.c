@@ -0,0 +1,1076 @@
+/**
+ * @file x86.c
+ * @brief
+ * The x86-64 backend: lowers IR instructions (see ir.h) into slots, and IR
+ * blocks into straight-line code after them (see lower.h). UM register i
+ * lives in r8 + i, rcx holds the usable memory base, and rbx the address of
+ * the handler that everything calling out goes through.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include "utility.h"
+#include "ir.h"
+#include "lower.h"
+#include "opt.h"
+
+/* Longest code an instruction lowers to, in a block */
+#define MAX_INSN 24
+
+typedef struct
+{
+    uint8_t *code;
+    size_t len;
+    size_t cap;
+} Area_T;
+
+/* Where a block starts, and where its code is in the area */
+typedef struct
+{
+    uint32_t pc;
+    size_t at;
+} Entry_T;
+
+static uint8_t *imm32(uint8_t *p, uint32_t value)
+{
+    *p++ = value & 0xFF;
+    *p++ = (value >> 8) & 0xFF;
+    *p++ = (value >> 16) & 0xFF;
+    *p++ = (value >> 24) & 0xFF;
+    return p;
+}
+
+static bool fits_imm8(uint32_t value)
+{
+    return (int32_t)value >= -128 && (int32_t)value <= 127;
+}
+
+static uint8_t *load_reg(uint8_t *p, unsigned a, uint32_t value)
+{
+    if (value == 0)
+    {
+        /* xor %rAd, %rAd */
+        *p++ = 0x45;
+        *p++ = 0x31;
+        *p++ = 0xC0 | (a << 3) | a;
+        return p;
+    }
+
+    /* Load 32 bit value into register rAd */
+    /* mov imm32, %rAd */
+    *p++ = 0x41;
+    *p++ = 0xC7;
+    *p++ = 0xC0 | a;
+
+    *p++ = value & 0xFF;
+    *p++ = (value >> 8) & 0xFF;
+    *p++ = (value >> 16) & 0xFF;
+    *p++ = (value >> 24) & 0xFF;
+
+    return p;
+}
+
+static uint8_t *cond_move(uint8_t *p, unsigned a, unsigned b, unsigned c)
+{
+    /* test %rCd, %rCd */
+    *p++ = 0x45;
+    *p++ = 0x85;
+    *p++ = 0xc0 | (c << 3) | c;
+
+    /* If rCd is not 0, move %rAd into %rBd */
+    /* cmovne %rBd, %rAd */
+    *p++ = 0x45;
+    *p++ = 0x0F;
+    *p++ = 0x45;
+    *p++ = 0xC0 | (a << 3) | b;
+
+    return p;
+}
+
+/* Where a segment's address is put: rax in the slots. Blocks keep addresses
+ * in rdx and rdi, which only the call-outs and Multiply and Divide touch. */
+#define RAX 0
+#define RDX 2
+#define RDI 7
+
+static uint8_t *seg_base(uint8_t *p, unsigned to, unsigned r)
+{
+    if (indirect_mode) {
+        /* Look the segment up in the handle table */
+        /* mov (%rcx, %rRd, 8), %(to) */
+        *p++ = 0x4a;
+        *p++ = 0x8b;
+        *p++ = 0x04 | (to << 3);
+        *p++ = 0xc1 | (r << 3);
+    }
+
+    else {
+        /* lea (%rcx, %rRd, 1), %(to) */
+        *p++ = 0x4a;
+        *p++ = 0x8d;
+        *p++ = 0x04 | (to << 3);
+        *p++ = 0x01 | (r << 3);
+    }
+
+    return p;
+}
+
+static uint8_t *load_at(uint8_t *p, unsigned base, unsigned a, unsigned c)
+{
+    /* mov (%(base), %rCd, 4), %rAd */
+    *p++ = 0x46;
+    *p++ = 0x8B;
+    *p++ = 0x04 | (a << 3);
+    *p++ = 0x80 | (c << 3) | base;
+
+    return p;
+}
+
+static uint8_t *store_at(uint8_t *p, unsigned base, unsigned b, unsigned c)
+{
+    /* mov %rCd, (%(base), %rBd, 4) */
+    *p++ = 0x46;
+    *p++ = 0x89;
+    *p++ = 0x04 | (c << 3);
+    *p++ = 0x80 | (b << 3) | base;
+
+    /* Super hacky method for handling recompile: use the output of the lea
+     * instruction as an else case: the Virt32 memory allocator always
+     * allocates along 32-byte boundaries, which means that the lower 5 bits
+     * will always be 0. This means that with opcodes 1-31 will be safe to use
+     * for special cases, and the 0 or >32 opcodes can be used for the recompile
+     * instruction. */
+    if (SELF_MODIFYING) {
+        /* Unconditionally branch to the handler
+         * This is super inefficient, and has been implemented somewhat as an
+         * afterthought. */
+        *p++ = 0xff;
+        *p++ = 0xd3;
+    }
+
+    return p;
+}
+
+static uint8_t *seg_load(uint8_t *p, unsigned a, unsigned b, unsigned c)
+{
+    /* rA = m[rB][rC]*/
+    return load_at(seg_base(p, RAX, b), RAX, a, c);
+}
+
+static uint8_t *seg_store(uint8_t *p, unsigned a, unsigned b, unsigned c)
+{
+    /* m[rA][rB] = rC */
+    return store_at(seg_base(p, RAX, a), RAX, b, c);
+}
+
+static uint8_t *add_regs(uint8_t *p, unsigned a, unsigned b, unsigned c)
+{
+    /* rA = rB + rC % 2^32 */
+    /* mov %rBd, %eax */
+    *p++ = 0x44;
+    *p++ = 0x89;
+    *p++ = 0xC0 | (b << 3);
+
+    /* add %rCd, %eax */
+    *p++ = 0x44;
+    *p++ = 0x01;
+    *p++ = 0xC0 | (c << 3);
+
+    /* mov %eax, %rAd */
+    *p++ = 0x41;
+    *p++ = 0x89;
+    *p++ = 0xC0 | a;
+
+    return p;
+}
+
+static uint8_t *mult_regs(uint8_t *p, unsigned a, unsigned b, unsigned c)
+{
+    /* mov %rBd, %eax */
+    *p++ = 0x44;
+    *p++ = 0x89;
+    *p++ = 0xC0 | (b << 3);
+
+    /* mul %rCd, %eax */
+    *p++ = 0x41;
+    *p++ = 0xF7;
+    *p++ = 0xE0 | c;
+
+    /* mov %eax, %rAd */
+    *p++ = 0x41;
+    *p++ = 0x89;
+    *p++ = 0xC0 | a;
+
+    return p;
+}
+
+static uint8_t *div_regs(uint8_t *p, unsigned a, unsigned b, unsigned c)
+{
+    /* xor %edx, %edx */
+    *p++ = 0x31;
+    *p++ = 0xd2;
+
+    /* Put the dividend (register b) in %eax */
+    /* mov %rBd, %eax */
+    *p++ = 0x44;
+    *p++ = 0x89;
+    *p++ = 0xC0 | (b << 3);
+
+    /* div %rC, %rax */
+    *p++ = 0x49;
+    *p++ = 0xF7;
+    *p++ = 0xF0 | c;
+
+    /* Exchange %eax with the target destination register */
+    /* xchg %eax, %rAd */
+    *p++ = 0x41;
+    *p++ = 0x90 | a;
+
+    return p;
+}
+
+static uint8_t *nand_regs(uint8_t *p, unsigned a, unsigned b, unsigned c)
+{
+    /* Thank you to Tom Hebb for figuring out this clever approach for saving a
+     * an instruction.
+     * When r1 = r0 NAND r1, or r1 = r1 NAND r0, we want to use the source
+     * register that is the same as the destination register as the destination,
+     * and be sure to avoid clobbering the other source register. 
+     * For instructions where all 3 registers are the same or are different,
+     * this is not a concern.
+     */
+
+    unsigned move, keep;
+    if (a == c) {
+        move = c;
+        keep = b;
+    }
+
+    else {
+        move = b;
+        keep = c;
+    }
+
+
+    /* mov %(Move register), %rAd, */
+    *p++ = 0x45;
+    *p++ = 0x8b;
+    *p++ = 0xc0 | (a << 3) | move;
+
+    /* and %(Keep register), %rAd */
+    *p++ = 0x45;
+    *p++ = 0x23;
+    *p++ = 0xc0 | (a << 3) | keep;
+
+    /* not %rAd */
+    *p++ = 0x41;
+    *p++ = 0xf7;
+    *p++ = 0xd0 | a;
+
+    return p;
+}
+
+/* The rest lower the instructions passes write, and only run in blocks */
+
+static uint8_t *move_reg(uint8_t *p, unsigned a, unsigned b)
+{
+    if (a == b)
+        return p;
+
+    /* mov %rBd, %rAd */
+    *p++ = 0x45;
+    *p++ = 0x89;
+    *p++ = 0xC0 | (b << 3) | a;
+    return p;
+}
+
+static uint8_t *add_const(uint8_t *p, unsigned a, unsigned b, uint32_t k)
+{
+    if (a == b)
+    {
+        /* add imm, %rAd */
+        *p++ = 0x41;
+        *p++ = fits_imm8(k) ? 0x83 : 0x81;
+        *p++ = 0xC0 | a;
+        if (fits_imm8(k))
+            *p++ = k & 0xFF;
+        else
+            p = imm32(p, k);
+        return p;
+    }
+
+    /* lea disp(%rB), %rAd, which wraps at 32 bits like the add. r12 as a
+     * base needs a SIB byte. */
+    *p++ = 0x45;
+    *p++ = 0x8D;
+    *p++ = (fits_imm8(k) ? 0x40 : 0x80) | (a << 3) | b;
+    if (b == 4)
+        *p++ = 0x24;
+    if (fits_imm8(k))
+        *p++ = k & 0xFF;
+    else
+        p = imm32(p, k);
+    return p;
+}
+
+/* Shift rAd by s, left by 0xE0 or right by 0xE8 */
+static uint8_t *shift_reg(uint8_t *p, uint8_t dir, unsigned a, unsigned s)
+{
+    /* shl/shr imm8, %rAd */
+    *p++ = 0x41;
+    *p++ = 0xC1;
+    *p++ = dir | a;
+    *p++ = s;
+    return p;
+}
+
+static uint8_t *mult_const(uint8_t *p, unsigned a, unsigned b, uint32_t k)
+{
+    unsigned s = 0;
+    while (s < 31 && ((uint32_t)1 << s) < k)
+        s++;
+    if (((uint32_t)1 << s) == k)
+        return shift_reg(move_reg(p, a, b), 0xE0, a, s);
+
+    if (k == 3 || k == 5 || k == 9)
+    {
+        /* lea (%rB, %rB, k - 1), %rAd. r13 as a base needs a displacement. */
+        *p++ = 0x47;
+        *p++ = 0x8D;
+        *p++ = (b == 5 ? 0x44 : 0x04) | (a << 3);
+        *p++ = (k == 3 ? 0x40 : k == 5 ? 0x80 : 0xC0) | (b << 3) | b;
+        if (b == 5)
+            *p++ = 0x00;
+        return p;
+    }
+
+    /* imul imm, %rBd, %rAd */
+    *p++ = 0x45;
+    *p++ = fits_imm8(k) ? 0x6B : 0x69;
+    *p++ = 0xC0 | (a << 3) | b;
+    if (fits_imm8(k))
+        *p++ = k & 0xFF;
+    else
+        p = imm32(p, k);
+    return p;
+}
+
+/* Division by a constant k that is not a power of 2: with m = ceil(2^64 / k),
+ * the high half of rB * m is rB / k for every 32 bit rB */
+static uint8_t *div_const(uint8_t *p, unsigned a, unsigned b, uint32_t k)
+{
+    uint64_t m = UINT64_MAX / k + 1;
+
+    /* mov %rBd, %eax */
+    *p++ = 0x44;
+    *p++ = 0x89;
+    *p++ = 0xC0 | (b << 3);
+
+    /* movabs imm64, %rdx */
+    *p++ = 0x48;
+    *p++ = 0xBA;
+    p = imm32(p, (uint32_t)m);
+    p = imm32(p, (uint32_t)(m >> 32));
+
+    /* mul %rdx */
+    *p++ = 0x48;
+    *p++ = 0xF7;
+    *p++ = 0xE2;
+
+    /* mov %edx, %rAd */
+    *p++ = 0x41;
+    *p++ = 0x89;
+    *p++ = 0xD0 | a;
+    return p;
+}
+
+/* op %rCd, %rAd for op one of and (0x21), or (0x09) and xor (0x31) */
+static uint8_t *logic_reg(uint8_t *p, uint8_t op, unsigned a, unsigned c)
+{
+    *p++ = 0x45;
+    *p++ = op;
+    *p++ = 0xC0 | (c << 3) | a;
+    return p;
+}
+
+static uint8_t *not_reg(uint8_t *p, unsigned a, unsigned b)
+{
+    /* not %rAd */
+    p = move_reg(p, a, b);
+    *p++ = 0x41;
+    *p++ = 0xF7;
+    *p++ = 0xD0 | a;
+    return p;
+}
+
+/* rA = rB op rC, for and, or and xor */
+static uint8_t *logic_regs(uint8_t *p, uint8_t op, unsigned a, unsigned b,
+                           unsigned c)
+{
+    if (a == c)
+        return logic_reg(p, op, a, b);
+    return logic_reg(move_reg(p, a, b), op, a, c);
+}
+
+/* rA = rB op ~rC, for and and or. Without andn, ~rC is worked out in eax
+ * unless rA is rC alone. */
+static uint8_t *logic_not_regs(uint8_t *p, uint8_t op, unsigned a, unsigned b,
+                               unsigned c)
+{
+    if (op == 0x21 && (lower_features() & LOWER_BMI))
+    {
+        /* andn %rBd, %rCd, %rAd */
+        *p++ = 0xC4;
+        *p++ = 0x42;
+        *p++ = (7 - c) << 3;
+        *p++ = 0xF2;
+        *p++ = 0xC0 | (a << 3) | b;
+        return p;
+    }
+
+    if (a == c && a != b)
+        return logic_reg(not_reg(p, a, a), op, a, b);
+
+    /* mov %rCd, %eax; not %eax; op %eax, %rAd */
+    p = move_reg(p, a, b);
+    *p++ = 0x44;
+    *p++ = 0x89;
+    *p++ = 0xC0 | (c << 3);
+    *p++ = 0xF7;
+    *p++ = 0xD0;
+    *p++ = 0x41;
+    *p++ = op;
+    *p++ = 0xC0 | a;
+    return p;
+}
+
+static uint8_t *handle_halt(uint8_t *p)
+{
+    /* Move the Halt opcode into %al */
+    /* mov imm8, %al */
+    *p++ = 0xb0;
+    *p++ = 0x00 | OP_HALT;
+
+    /* Jump to large op function address (NOTE: jump, not call) */
+    /* jmp *%rbx */
+    *p++ = 0xff;
+    *p++ = 0xe3;
+
+    return p;
+}
+
+static uint8_t *inject_map_segment(uint8_t *p, unsigned b, unsigned c)
+{
+    /* Move register c to be the function call argument */
+    /* mov %rCd, %edi */
+    *p++ = 0x44;
+    *p++ = 0x89;
+    *p++ = 0xc7 | (c << 3);
+    
+    /* Move the Map opcode into %al */
+    /* mov imm8, %al */
+    *p++ = 0xb0;
+    *p++ = 0x00 | OP_MAP;
+
+    /* Call the large op function handler */
+    /* call *%rbx */
+    *p++ = 0xff;
+    *p++ = 0xd3;
+
+    /* Move return value from %rax to register b */
+    /* mov %rax, %rBd */
+    *p++ = 0x41;
+    *p++ = 0x89;
+    *p++ = 0xc0 | b;
+
+    return p;
+}
+
+static uint8_t *inject_unmap_segment(uint8_t *p, unsigned c)
+{
+    /* Move register c to be the function argument */
+    /* mov %rCd, %edi */
+    *p++ = 0x44;
+    *p++ = 0x89;
+    *p++ = 0xc7 | (c << 3);
+
+    /* Move the Unmap opcode into %al */
+    /* mov imm8, %al */
+    *p++ = 0xb0;
+    *p++ = 0x00 | OP_UNMAP;
+
+    /* Call the large op function handler */
+    /* call *%rbx */
+    *p++ = 0xff;
+    *p++ = 0xd3;
+
+    return p;
+}
+
+static uint8_t *print_reg(uint8_t *p, unsigned c)
+{
+    /* Move register c to be the function argument */
+    /* mov %rCd, %edi */
+    *p++ = 0x44;
+    *p++ = 0x89;
+    *p++ = 0xc7 | (c << 3);
+
+    /* Move the Print Out opcode into %al */
+    /* mov imm8, %al */
+    *p++ = 0xb0;
+    *p++ = 0x00 | OP_OUT;
+
+    /* Call the large op function handler */
+    /* call *%rbx */
+    *p++ = 0xff;
+    *p++ = 0xd3;
+
+    return p;
+}
+
+static uint8_t *read_into_reg(uint8_t *p, unsigned c)
+{
+    /* Move the Read In opcode into %al */
+    /* mov imm8, %al */
+    *p++ = 0xb0;
+    *p++ = 0x00 | OP_IN;
+
+    /* Call the large op function handler */
+    /* call *%rbx */
+    *p++ = 0xff;
+    *p++ = 0xd3;
+
+    /* Store the result in register c */
+    /* mov %eax, %rCd */
+    *p++ = 0x41;
+    *p++ = 0x89;
+    *p++ = 0xC0 | c;
+
+    return p;
+}
+
+static uint8_t *inject_load_program(uint8_t *p, unsigned b, unsigned c)
+{
+    /* mov %rCd, %esi (updating the program counter) */
+    *p++ = 0x44;
+    *p++ = 0x89;
+    *p++ = 0xc6 | (c << 3);
+
+    /* mov %rBd, %edi (to test with a known register in assembly)*/
+    *p++ = 0x44;
+    *p++ = 0x89;
+    *p++ = 0xc7 | (b << 3);
+
+    /* Move the Duplicate segment opcode into %al */
+    /* mov imm8, %al */
+    *p++ = 0xb0;
+    *p++ = 0x00 | OP_DUPLICATE;
+
+    /* jump to load program function address (NOTE: jump, not call) */
+    /* jmp *%rbx */
+    *p++ = 0xff;
+    *p++ = 0xe3;
+
+    return p;
+}
+
+static uint8_t *lower_insn(uint8_t *p, const Ir_Insn *insn)
+{
+    unsigned a = insn->a, b = insn->b, c = insn->c;
+
+    switch (insn->op)
+    {
+    case IR_CMOV:
+        return cond_move(p, a, b, c);
+    case IR_LOAD:
+        return seg_load(p, a, b, c);
+    case IR_STORE:
+        return seg_store(p, a, b, c);
+    case IR_ADD:
+        return add_regs(p, a, b, c);
+    case IR_MUL:
+        return mult_regs(p, a, b, c);
+    case IR_DIV:
+        return div_regs(p, a, b, c);
+    case IR_NAND:
+        return nand_regs(p, a, b, c);
+    case IR_HALT:
+        return handle_halt(p);
+    case IR_MAP:
+        return inject_map_segment(p, b, c);
+    case IR_UNMAP:
+        return inject_unmap_segment(p, c);
+    case IR_OUT:
+        return print_reg(p, c);
+    case IR_IN:
+        return read_into_reg(p, c);
+    case IR_JUMP:
+        return inject_load_program(p, b, c);
+    case IR_CONST:
+        return load_reg(p, a, insn->value);
+    case IR_MOV:
+        return move_reg(p, a, b);
+    case IR_ADDK:
+        return add_const(p, a, b, insn->value);
+    case IR_MULK:
+        return mult_const(p, a, b, insn->value);
+    case IR_SHR:
+        return shift_reg(move_reg(p, a, b), 0xE8, a, insn->value);
+    case IR_DIVK:
+        return div_const(p, a, b, insn->value);
+    case IR_NOT:
+        return not_reg(p, a, b);
+    case IR_AND:
+        return logic_regs(p, 0x21, a, b, c);
+    case IR_OR:
+        return logic_regs(p, 0x09, a, b, c);
+    case IR_XOR:
+        return logic_regs(p, 0x31, a, b, c);
+    case IR_ANDN:
+        return logic_not_regs(p, 0x21, a, b, c);
+    case IR_ORN:
+        return logic_not_regs(p, 0x09, a, b, c);
+    default:
+        return p;
+    }
+}
+
+/* The recommended no op of each length, for padding slots */
+static const uint8_t nops[10][9] = {
+    {0},
+    {0x90},
+    {0x66, 0x90},
+    {0x0F, 0x1F, 0x00},
+    {0x0F, 0x1F, 0x40, 0x00},
+    {0x0F, 0x1F, 0x44, 0x00, 0x00},
+    {0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00},
+    {0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00},
+    {0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+    {0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+};
+
+/* One instruction in its slot, padded with a no op */
+static void lower_slot(uint8_t *slot, const Ir_Insn *insn)
+{
+    uint8_t *p = lower_insn(slot, insn);
+    size_t pad = slot + CHUNK - p;
+    assert(pad <= CHUNK);
+
+    if (pad > 9)
+    {
+        *p++ = 0x90;
+        pad--;
+    }
+    memcpy(p, nops[pad], pad);
+}
+
+/* jmp rel32, from code at offset from to offset to */
+static uint8_t *jump(uint8_t *p, size_t from, size_t to)
+{
+    int64_t rel = (int64_t)to - (int64_t)(from + 5);
+    assert(rel == (int32_t)rel);
+
+    *p++ = 0xE9;
+    *p++ = rel & 0xFF;
+    *p++ = (rel >> 8) & 0xFF;
+    *p++ = (rel >> 16) & 0xFF;
+    *p++ = (rel >> 24) & 0xFF;
+    return p;
+}
+
+/* A block is worth its two extra jumps if it saves a trip through the slots
+ * for more than one instruction. It cannot run off the end of the segment,
+ * which the slots leave to the bytes after them. */
+static bool worth_it(const Ir_Block *block, uint32_t n)
+{
+    uint32_t body = 0;
+    for (uint32_t i = 0; i < block->n; i++)
+        body += block->insns[i].op != IR_NOP && !ir_exits(block->insns[i].op);
+
+    const Ir_Insn *last = &block->insns[block->n - 1];
+    return body >= 2 && (ir_exits(last->op) || block->start + block->words < n);
+}
+
+/* The segments whose addresses rdx and rdi hold in a block, by the UM
+ * register that names them, or -1 */
+typedef struct
+{
+    int held[2];
+    unsigned recent; /* Which was used last */
+} Bases_T;
+
+static const unsigned base_regs[2] = {RDX, RDI};
+
+/* Load or Store through the address of the segment, worked out only if
+ * neither scratch register has it */
+static uint8_t *lower_access(uint8_t *p, const Ir_Insn *insn, Bases_T *bases)
+{
+    bool load = insn->op == IR_LOAD;
+    int seg = load ? insn->b : insn->a;
+
+    int i = bases->held[0] == seg ? 0 : bases->held[1] == seg ? 1 : -1;
+    if (i < 0)
+    {
+        i = bases->held[0] < 0 ? 0 : bases->held[1] < 0 ? 1 : !bases->recent;
+        p = seg_base(p, base_regs[i], seg);
+        bases->held[i] = seg;
+    }
+    bases->recent = i;
+
+    if (load)
+        return load_at(p, base_regs[i], insn->a, insn->c);
+    return store_at(p, base_regs[i], insn->b, insn->c);
+}
+
+/* Drop the addresses an instruction has made stale */
+static void forget_bases(Bases_T *bases, const Ir_Insn *insn)
+{
+    for (int i = 0; i < 2; i++)
+        if (bases->held[i] >= 0 && (insn->def & (1u << bases->held[i])))
+            bases->held[i] = -1;
+
+    /* These leave the high half of a product in rdx */
+    if (insn->op == IR_MUL || insn->op == IR_DIV || insn->op == IR_DIVK)
+        bases->held[0] = -1;
+}
+
+/* Make room for len more bytes at the end of the area */
+static void reserve(Area_T *area, size_t len)
+{
+    if (area->cap - area->len < len)
+    {
+        area->cap = area->cap * 2 + len;
+        area->code = realloc(area->code, area->cap);
+        assert(area->code != NULL);
+    }
+}
+
+/* Lower the first n instructions of a block straight through */
+static uint8_t *lower_body(uint8_t *p, const Ir_Block *block, uint32_t n,
+                           Bases_T *bases)
+{
+    for (uint32_t i = 0; i < n; i++)
+    {
+        const Ir_Insn *insn = &block->insns[i];
+        uint8_t *at = p;
+        if (insn->op == IR_LOAD || insn->op == IR_STORE)
+            p = lower_access(p, insn, bases);
+        else
+            p = lower_insn(p, insn);
+        assert(p - at <= MAX_INSN);
+        forget_bases(bases, insn);
+    }
+    return p;
+}
+
+/* Lower a block to the end of the area, which starts at offset base in the
+ * compiled code */
+static void lower_block(Area_T *area, size_t base, const Ir_Block *block)
+{
+    reserve(area, (block->n + 1) * MAX_INSN);
+
+    uint8_t *p = area->code + area->len;
+    const Ir_Insn *last = &block->insns[block->n - 1];
+    bool exits = ir_exits(last->op);
+    Bases_T bases = {{-1, -1}, 0};
+    p = lower_body(p, block, block->n - exits, &bases);
+
+    /* Halt and Load Program jump to the handler, so they can run here. The
+     * rest run in their slots, and a block cut short goes on in the next. */
+    if (last->op == IR_HALT || last->op == IR_JUMP)
+        p = lower_insn(p, last);
+    else
+    {
+        uint32_t next = block->start + block->words - exits;
+        size_t from = base + (p - area->code);
+        p = jump(p, from, (size_t)next * CHUNK);
+    }
+
+    area->len = p - area->code;
+}
+
+/* After the last slot: take PC n to the dispatcher, as a jump would */
+static uint8_t *end_slot(uint8_t *p, uint32_t n)
+{
+    /* mov $n, %esi */
+    *p++ = 0xBE;
+    memcpy(p, &n, 4);
+    p += 4;
+
+    /* xor %edi, %edi; mov imm8, %al; jmp *%rbx */
+    *p++ = 0x31;
+    *p++ = 0xFF;
+    *p++ = 0xb0;
+    *p++ = 0x00 | OP_DUPLICATE;
+    *p++ = 0xff;
+    *p++ = 0xe3;
+    return p;
+}
+
+uint32_t lower_features(void)
+{
+    return __builtin_cpu_supports("bmi") ? LOWER_BMI : 0;
+}
+
+uint8_t *lower_segment(const uint32_t *words, uint32_t n, size_t *size)
+{
+    *size = 0;
+    if (n == 0)
+        return NULL;
+
+    /* Blocks go after the slots, so where each lands is known before the
+     * slots are written */
+    size_t slots = (size_t)n * CHUNK + END_SLOT;
+    Area_T area = {NULL, 0, 0};
+    Entry_T *entries = NULL;
+    size_t count = 0, cap = 0;
+
+    if (!SELF_MODIFYING)
+    {
+        bool *leader = ir_leaders(words, n);
+        Ir_Block *block = malloc(sizeof(Ir_Block));
+        assert(block != NULL);
+
+        for (uint32_t pc = 0; pc < n;)
+        {
+            /* A block that only exits is its slot */
+            if (ir_exits(words[pc] >> 28))
+            {
+                pc++;
+                continue;
+            }
+
+            uint32_t next = ir_block(words, n, leader, pc, block);
+            opt_constants(block);
+            opt_logic(block);
+            opt_memory(block);
+            opt_dead(block);
+            if (worth_it(block, n))
+            {
+                if (count == cap)
+                {
+                    cap = cap * 2 + 64;
+                    entries = realloc(entries, cap * sizeof(Entry_T));
+                    assert(entries != NULL);
+                }
+                entries[count++] = (Entry_T){pc, slots + area.len};
+                lower_block(&area, slots, block);
+            }
+            pc = next;
+        }
+
+        free(block);
+        free(leader);
+    }
+
+    *size = slots + area.len;
+    uint8_t *code = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(code != MAP_FAILED);
+
+    for (uint32_t pc = 0; pc < n; pc++)
+    {
+        Ir_Insn insn = ir_decode(words[pc]);
+        lower_slot(code + (size_t)pc * CHUNK, &insn);
+    }
+    end_slot(code + (size_t)n * CHUNK, n);
+
+    if (area.len > 0)
+        memcpy(code + slots, area.code, area.len);
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t from = (size_t)entries[i].pc * CHUNK;
+        jump(code + from, from, entries[i].at);
+    }
+
+    free(area.code);
+    free(entries);
+    return code;
+}
+
+/* A way out of a path: a branch to a stub after the path's code that puts
+ * the next PC in rax for the dispatcher */
+typedef struct
+{
+    size_t from;   /* Where the branch's rel32 is */
+    bool jumped;   /* Left by a jump, which the dispatcher spends fuel on */
+    bool reg;      /* value is the UM register holding the PC */
+    uint32_t value;
+} Exit_T;
+
+/* j<cc> rel32 to an exit, filled in once the stubs are placed */
+static uint8_t *branch(uint8_t *p, uint8_t cc, const uint8_t *code,
+                       Exit_T *exit)
+{
+    *p++ = 0x0F;
+    *p++ = cc;
+    exit->from = p - code;
+    return imm32(p, 0);
+}
+
+/* Check a Load Program on a path still goes where it went, then spend its
+ * fuel the way the dispatcher would */
+static uint8_t *guard(uint8_t *p, const uint8_t *code, const Ir_Block *piece,
+                      Exit_T *exits, size_t *count)
+{
+    const Ir_Insn *jump = &piece->insns[piece->n - 1];
+    unsigned b = jump->b, c = jump->c;
+
+    /* test %rBd, %rBd: another segment is loaded in the slot */
+    *p++ = 0x45;
+    *p++ = 0x85;
+    *p++ = 0xC0 | (b << 3) | b;
+    exits[*count] = (Exit_T){0, false, false, piece->start + piece->words - 1};
+    p = branch(p, 0x85, code, &exits[(*count)++]);
+
+    /* cmp imm32, %rCd: the jump goes somewhere else */
+    *p++ = 0x41;
+    *p++ = 0x81;
+    *p++ = 0xF8 | c;
+    p = imm32(p, jump->value);
+    exits[*count] = (Exit_T){0, true, true, c};
+    p = branch(p, 0x85, code, &exits[(*count)++]);
+
+    /* mov (%rsp), %rax; cmpq $1, fuel(%rax): the last unit is left to the
+     * dispatcher, which stops there */
+    *p++ = 0x48;
+    *p++ = 0x8B;
+    *p++ = 0x04;
+    *p++ = 0x24;
+    *p++ = 0x48;
+    *p++ = 0x83;
+    *p++ = 0x78;
+    *p++ = MACHINE_FUEL;
+    *p++ = 0x01;
+    exits[*count] = (Exit_T){0, true, false, jump->value};
+    p = branch(p, 0x86, code, &exits[(*count)++]);
+
+    /* decq fuel(%rax) */
+    *p++ = 0x48;
+    *p++ = 0xFF;
+    *p++ = 0x48;
+    *p++ = MACHINE_FUEL;
+    return p;
+}
+
+uint8_t *lower_path(const Path_T *path, size_t *size)
+{
+    size_t insns = 0;
+    for (uint32_t i = 0; i < path->count; i++)
+        insns += path->pieces[i].n;
+
+    /* A guard and its three stubs fit in four instructions' room */
+    Area_T area = {NULL, 0, 0};
+    reserve(&area, (insns + 4 * (size_t)path->count + 16) * MAX_INSN);
+    Exit_T *exits = malloc((3 * (size_t)path->count + 1) * sizeof(Exit_T));
+    assert(exits != NULL);
+    size_t count = 0;
+    uint8_t *code = area.code, *p = code;
+
+    /* The function takes the Machine_T in rdi, and keeps it on the stack.
+     * The UM registers in r12 to r15 are the caller's to keep. */
+    *p++ = 0x41;
+    *p++ = 0x54;
+    *p++ = 0x41;
+    *p++ = 0x55;
+    *p++ = 0x41;
+    *p++ = 0x56;
+    *p++ = 0x41;
+    *p++ = 0x57;
+    *p++ = 0x57;
+
+    /* mov umem(%rdi), %rcx */
+    *p++ = 0x48;
+    *p++ = 0x8B;
+    *p++ = 0x4F;
+    *p++ = MACHINE_UMEM;
+
+    /* mov regs + 4 * i(%rdi), %rId */
+    for (unsigned i = 0; i < 8; i++)
+    {
+        *p++ = 0x44;
+        *p++ = 0x8B;
+        *p++ = 0x47 | (i << 3);
+        *p++ = MACHINE_REGS + 4 * i;
+    }
+
+    size_t head = p - code;
+    Bases_T bases = {{-1, -1}, 0};
+    for (uint32_t i = 0; i < path->count; i++)
+    {
+        const Ir_Block *piece = &path->pieces[i];
+        bool jumps = piece->insns[piece->n - 1].op == IR_JUMP;
+        p = lower_body(p, piece, piece->n - jumps, &bases);
+        if (jumps)
+            p = guard(p, code, piece, exits, &count);
+    }
+
+    if (path->loops)
+        p = jump(p, p - code, head);
+    else
+    {
+        *p++ = 0xE9;
+        exits[count] = (Exit_T){p - code, false, false, path->exit};
+        p = imm32(p, 0);
+        count++;
+    }
+
+    /* pop %rdi; mov %rId, regs + 4 * i(%rdi); pop r15 to r12; ret */
+    size_t leave = p - code;
+    *p++ = 0x5F;
+    for (unsigned i = 0; i < 8; i++)
+    {
+        *p++ = 0x44;
+        *p++ = 0x89;
+        *p++ = 0x47 | (i << 3);
+        *p++ = MACHINE_REGS + 4 * i;
+    }
+    *p++ = 0x41;
+    *p++ = 0x5F;
+    *p++ = 0x41;
+    *p++ = 0x5E;
+    *p++ = 0x41;
+    *p++ = 0x5D;
+    *p++ = 0x41;
+    *p++ = 0x5C;
+    *p++ = 0xC3;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const Exit_T *exit = &exits[i];
+        imm32(code + exit->from, (p - code) - (exit->from + 4));
+
+        if (exit->reg)
+        {
+            /* mov %rVd, %eax */
+            *p++ = 0x44;
+            *p++ = 0x89;
+            *p++ = 0xC0 | (exit->value << 3);
+        }
+        else
+        {
+            /* mov imm32, %eax */
+            *p++ = 0xB8;
+            p = imm32(p, exit->value);
+        }
+
+        /* bts $32, %rax, which is TIER_JUMPED */
+        if (exit->jumped)
+        {
+            *p++ = 0x48;
+            *p++ = 0x0F;
+            *p++ = 0xBA;
+            *p++ = 0xE8;
+            *p++ = 0x20;
+        }
+
+        p = jump(p, p - code, leave);
+    }
+    free(exits);
+
+    *size = p - code;
+    assert(*size <= area.cap);
+    return code;
+}